@@ -0,0 +1,233 @@
+#!/usr/bin/env python3
+"""
+Host-side decoder for binary log frames (built with -DLOG_BINARY)
+
+Each frame carries the address of its format string instead of the formatted
+text (see LOG_BIN_SYNC in include/uart/uart.h). The sync byte tells whether the
+address is in SRAM (.data) or flash (PSTR() strings in .text). The format
+strings are looked up in the program's .elf, or in a table previously dumped
+from it.
+
+Usage:
+    log_decode.py table <prog.elf>                 - print the format table
+    log_decode.py decode <prog.elf|table> [input]  - decode a capture file,
+                                                     serial port or stdin
+
+Bytes outside of frames (text from plain print() calls) are passed through.
+Headers with an unknown format address or an impossible length are passed
+through as text too, so a stray sync byte can't desync the decoder.
+"""
+
+import re
+import struct
+import sys
+
+LOG_BIN_SYNC = 0xA5
+LOG_BIN_SYNC_P = 0xA6
+# Frames are built in print_buf (PRINT_BUF_SIZE in log.c) after a 4 byte header
+LOG_BIN_MAX_PAYLOAD = 50 - 4
+
+# The AVR linker places RAM (.data) at this offset in the ELF address space
+AVR_DATA_OFFSET = 0x800000
+
+# printf conversions: flags, width, precision, length, conversion
+FMT_SPEC = re.compile(r"%([-+ #0]*)(\d*)(?:\.(\d+))?(hh|h|l)?([diouxXcsfeEgG%])")
+
+
+def read_elf(path):
+    """Returns ({name: (addr, data)}, [(name, value)]) for the sections and
+    symbols of a 32-bit LE ELF"""
+    with open(path, "rb") as f:
+        elf = f.read()
+    if elf[:4] != b"\x7fELF" or elf[4] != 1 or elf[5] != 1:
+        raise ValueError("%s: not a 32-bit little endian ELF" % path)
+
+    shoff, = struct.unpack_from("<I", elf, 0x20)
+    shentsize, shnum, shstrndx = struct.unpack_from("<HHH", elf, 0x2E)
+
+    headers = []
+    for i in range(shnum):
+        headers.append(struct.unpack_from("<IIIIIIIIII", elf, shoff + i * shentsize))
+    names = headers[shstrndx]
+    names = elf[names[4]:names[4] + names[5]]
+
+    sections = {}
+    symbols = []
+    for (name, typ, _, addr, off, size, link, _, _, entsize) in headers:
+        name = names[name:names.index(b"\0", name)].decode()
+        # SHT_NOBITS (.bss) has no data in the file
+        data = b"" if typ == 8 else elf[off:off + size]
+        sections[name] = (addr, data)
+
+        # SHT_SYMTAB
+        if typ == 2:
+            strtab = headers[link]
+            strtab = elf[strtab[4]:strtab[4] + strtab[5]]
+            for i in range(0, size, entsize):
+                sym_name, value = struct.unpack_from("<II", data, i)
+                sym_name = strtab[sym_name:strtab.index(b"\0", sym_name)]
+                symbols.append((sym_name.decode(), value))
+    return sections, symbols
+
+
+def read_string(data, start):
+    end = data.find(b"\0", start)
+    if end <= start:
+        return None
+    try:
+        return data[start:end].decode("ascii")
+    except UnicodeDecodeError:
+        return None
+
+
+def build_table(elf_path):
+    """Returns {(sync, address): string} for every string in the .data
+    section and every PSTR() string in flash"""
+    table = {}
+    sections, symbols = read_elf(elf_path)
+
+    if ".data" in sections:
+        addr, data = sections[".data"]
+        addr -= AVR_DATA_OFFSET
+        start = 0
+        for end, byte in enumerate(data):
+            if byte != 0:
+                continue
+            text = read_string(data, start)
+            if text is not None:
+                table[(LOG_BIN_SYNC, addr + start)] = text
+            start = end + 1
+
+    # PSTR() places each literal in .progmem.data (part of .text) under a
+    # local symbol named __c.<n>
+    addr, data = sections[".text"]
+    for name, value in symbols:
+        if name.startswith("__c.") and addr <= value < addr + len(data):
+            text = read_string(data, value - addr)
+            if text is not None:
+                table[(LOG_BIN_SYNC_P, value)] = text
+    return table
+
+
+def load_table(path):
+    if path.endswith(".elf"):
+        return build_table(path)
+    table = {}
+    with open(path) as f:
+        for line in f:
+            key, _, text = line.rstrip("\n").partition("\t")
+            sync, _, addr = key.partition(":")
+            table[(int(sync, 16), int(addr, 16))] = \
+                text.encode().decode("unicode_escape")
+    return table
+
+
+def arg_size(length, conv):
+    # int is 2 bytes on AVR, long and double are 4 (after default promotions)
+    if conv in "feEgG" or length == "l":
+        return 4
+    return 2
+
+
+def format_frame(table, sync, addr, payload):
+    if addr == 0:
+        return ":".join("%02x" % b for b in payload) + "\n"
+
+    fmt = table[(sync, addr)]
+    out = []
+    pos = 0
+    last = 0
+    for m in FMT_SPEC.finditer(fmt):
+        out.append(fmt[last:m.start()])
+        last = m.end()
+        flags, width, prec, length, conv = m.groups()
+        if conv == "%":
+            out.append("%")
+            continue
+
+        size = arg_size(length, conv)
+        raw = payload[pos:pos + size]
+        pos += size
+        if len(raw) < size:
+            out.append("<?>")
+            continue
+
+        if conv in "feEgG":
+            value = struct.unpack("<f", raw)[0]
+        elif conv in "di":
+            value = int.from_bytes(raw, "little", signed=True)
+        else:
+            value = int.from_bytes(raw, "little")
+        if conv == "s":
+            # Only strings in the table (in .data) can be recovered
+            value = table.get((LOG_BIN_SYNC, value), "<str 0x%04x>" % value)
+
+        spec = "%" + flags + width + ("." + prec if prec else "") + conv
+        out.append(spec % value)
+    out.append(fmt[last:])
+    return "".join(out)
+
+
+def decode(table, stream, out):
+    # Bytes read ahead for a header that turned out not to be one
+    pending = bytearray()
+
+    def read(n):
+        data = bytes(pending[:n])
+        del pending[:n]
+        if len(data) < n:
+            data += stream.read(n - len(data))
+        return data
+
+    while True:
+        byte = read(1)
+        if not byte:
+            return
+        if byte[0] not in (LOG_BIN_SYNC, LOG_BIN_SYNC_P):
+            out.write(byte.decode("ascii", "replace"))
+            continue
+
+        header = read(3)
+        if len(header) < 3:
+            return
+        addr = header[0] | (header[1] << 8)
+
+        # A sync byte in plain text or a corrupted frame would make the length
+        # swallow the frames after it. Only trust headers with a known format
+        # and a possible length, otherwise resync from the next byte
+        if header[2] > LOG_BIN_MAX_PAYLOAD or \
+                (addr != 0 and (byte[0], addr) not in table):
+            out.write(byte.decode("ascii", "replace"))
+            pending[:0] = header
+            continue
+
+        payload = read(header[2])
+        out.write(format_frame(table, byte[0], addr, payload))
+        out.flush()
+
+
+def open_input(name):
+    if name is None or name == "-":
+        return sys.stdin.buffer
+    if name.startswith("/dev/") or name.upper().startswith("COM"):
+        import serial
+        return serial.Serial(name, 9600)
+    return open(name, "rb")
+
+
+def main(argv):
+    if len(argv) >= 3 and argv[1] == "table":
+        for (sync, addr), text in sorted(build_table(argv[2]).items()):
+            print("%02x:%04x\t%s" % (sync, addr,
+                text.encode("unicode_escape").decode()))
+    elif len(argv) >= 3 and argv[1] == "decode":
+        table = load_table(argv[2])
+        decode(table, open_input(argv[3] if len(argv) > 3 else None), sys.stdout)
+    else:
+        print(__doc__.strip())
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -55,6 +55,12 @@ typedef struct {
     uint8_t addr;
 
     pin_info_t* rst;    
+
+    // Shadow copy of the GPIO registers written by the micro (bank A in the
+    // high byte), only meaningful for output pins
+    uint16_t gpio;
+    // 1 if gpio matches the device
+    uint8_t gpio_valid;
 } pex_t;
 
 void init_pex(pex_t*);
@@ -66,6 +72,9 @@ void write_pex_register(pex_t*, uint8_t addr, uint8_t data);
 uint16_t get_pex_bank_pair(pex_t* pex, uint8_t addr);
 void set_pex_bank_pair(pex_t* pex, uint8_t addr, uint16_t data);
 
+uint16_t get_pex_gpio(pex_t* pex);
+void set_pex_gpio(pex_t* pex, uint16_t data);
+
 void set_pex_pin_dir(pex_t* pex, pex_bank_t bank, uint8_t pin, pex_dir_t dir);
 void set_pex_pin(pex_t* pex, pex_bank_t bank, uint8_t pin, uint8_t state);
 uint8_t get_pex_pin(pex_t* pex, pex_bank_t bank, uint8_t pin);
@@ -7,6 +7,7 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/atomic.h>
 #include <string.h>
 #include <stdarg.h>
@@ -31,18 +32,127 @@ This is probably better than 1 MHz so we can reach higher UART baud rates.
 // UART RX callback function signature
 typedef uint8_t(*uart_rx_cb_t)(const uint8_t*, uint8_t);
 
+// What to do with a character when the TX buffer is full
+typedef enum {
+    // Wait for the interrupt to make room
+    UART_TX_BLOCK,
+    // Discard the character and count it in the drop counter
+    UART_TX_DROP
+} uart_tx_policy_t;
+
 
 // UART RX/TX (from uart.c)
 void init_uart(void);
 void put_uart_char(uint8_t c);
 void get_uart_char(uint8_t* c);
 void send_uart(const uint8_t* msg, uint8_t len);
+void send_uart_frame(const uint8_t* msg, uint8_t len);
 void set_uart_rx_cb(uart_rx_cb_t cb);
 uint8_t get_uart_rx_buf_count(void);
 void clear_uart_rx_buf(void);
+void set_uart_tx_policy(uart_tx_policy_t policy);
+uart_tx_policy_t get_uart_tx_policy(void);
+uint16_t get_uart_tx_drop_count(void);
 
 // Printing (from log.c)
 int16_t print(char* fmt, ...);
+int16_t print_P(const char* fmt, ...);
 void print_bytes(uint8_t* data, uint16_t len);
 
+// Prints with the format string kept in flash instead of SRAM
+#define PRINT(fmt, ...) print_P(PSTR(fmt), ##__VA_ARGS__)
+
+// Binary logging (from log.c)
+void log_bin_begin(const char* fmt);
+void log_bin_begin_P(const char* fmt);
+void log_bin_arg(const void* arg, uint8_t size);
+void log_bin_end(void);
+void log_bin_bytes(const uint8_t* data, uint8_t len);
+
+
+/*
+Log levels
+Messages above LOG_LEVEL are compiled out entirely, e.g. build with
+-DLOG_LEVEL=LOG_LEVEL_ERROR for flight
+*/
+#define LOG_LEVEL_NONE      0
+#define LOG_LEVEL_ERROR     1
+#define LOG_LEVEL_INFO      2
+#define LOG_LEVEL_DEBUG     3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+/*
+Binary log frames
+Building with -DLOG_BINARY replaces the formatted text with a frame holding the
+address of the format string and the raw argument bytes (after the default
+argument promotions, so 2 bytes for int, 4 for long/float, little endian):
+
+    sync, fmt address (LSB first), payload length, payload
+
+The sync byte tells whether the address is in SRAM (LOG_BIN_SYNC) or flash
+(LOG_BIN_SYNC_P, used by the LOG_* macros).
+bin/log_decode.py rebuilds the text on the host from the program's .elf
+A frame with a format address of 0 holds raw bytes from LOG_*_BYTES
+*/
+#define LOG_BIN_SYNC        0xA5
+#define LOG_BIN_SYNC_P      0xA6
+
+// fmt must be a string literal, it is placed in flash
+#ifdef LOG_BINARY
+#define LOG_EMIT(fmt, ...) \
+    do { \
+        log_bin_begin_P(PSTR(fmt)); \
+        LOG_BIN_ARGS(__VA_ARGS__) \
+        log_bin_end(); \
+    } while (0)
+#define LOG_EMIT_BYTES(data, len) log_bin_bytes((data), (len))
+#else
+#define LOG_EMIT(fmt, ...) PRINT(fmt, ##__VA_ARGS__)
+#define LOG_EMIT_BYTES(data, len) print_bytes((data), (len))
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(fmt, ...) LOG_EMIT(fmt, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(fmt, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(fmt, ...) LOG_EMIT(fmt, ##__VA_ARGS__)
+#else
+#define LOG_INFO(fmt, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(fmt, ...) LOG_EMIT(fmt, ##__VA_ARGS__)
+#define LOG_DEBUG_BYTES(data, len) LOG_EMIT_BYTES(data, len)
+#else
+#define LOG_DEBUG(fmt, ...) do {} while (0)
+#define LOG_DEBUG_BYTES(data, len) do {} while (0)
+#endif
+
+// Expands to one log_bin_arg() call per argument (up to 8)
+#define LOG_BIN_ARG(a) \
+    { \
+        __typeof__((a) + 0) log_arg_ = (a); \
+        log_bin_arg(&log_arg_, sizeof(log_arg_)); \
+    }
+#define LOG_NARGS(...) LOG_NARGS_(_, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_, a1, a2, a3, a4, a5, a6, a7, a8, n, ...) n
+#define LOG_CAT(a, b) LOG_CAT_(a, b)
+#define LOG_CAT_(a, b) a##b
+#define LOG_BIN_ARGS(...) LOG_CAT(LOG_BIN_ARGS_, LOG_NARGS(__VA_ARGS__))(__VA_ARGS__)
+#define LOG_BIN_ARGS_0()
+#define LOG_BIN_ARGS_1(a) LOG_BIN_ARG(a)
+#define LOG_BIN_ARGS_2(a, ...) LOG_BIN_ARG(a) LOG_BIN_ARGS_1(__VA_ARGS__)
+#define LOG_BIN_ARGS_3(a, ...) LOG_BIN_ARG(a) LOG_BIN_ARGS_2(__VA_ARGS__)
+#define LOG_BIN_ARGS_4(a, ...) LOG_BIN_ARG(a) LOG_BIN_ARGS_3(__VA_ARGS__)
+#define LOG_BIN_ARGS_5(a, ...) LOG_BIN_ARG(a) LOG_BIN_ARGS_4(__VA_ARGS__)
+#define LOG_BIN_ARGS_6(a, ...) LOG_BIN_ARG(a) LOG_BIN_ARGS_5(__VA_ARGS__)
+#define LOG_BIN_ARGS_7(a, ...) LOG_BIN_ARG(a) LOG_BIN_ARGS_6(__VA_ARGS__)
+#define LOG_BIN_ARGS_8(a, ...) LOG_BIN_ARG(a) LOG_BIN_ARGS_7(__VA_ARGS__)
+
 #endif // UART_H
@@ -28,6 +28,7 @@ Initializes port expander reset and chip select pins on the 32M1
 pex - pointer to the pex device
 */
 void init_pex(pex_t* pex) {
+    pex->gpio_valid = 0;
     // Init RST if it's enabled
     if(pex->rst != NULL){
         init_cs(pex->rst->pin, pex->rst->ddr);
@@ -41,6 +42,7 @@ Resets the port expander
 pex - pointer to the pex device
 */
 void reset_pex(pex_t* pex) {
+    pex->gpio_valid = 0;
     // Reset the port expander if it's enabled
     if (pex->rst != NULL){
         set_cs_low(pex->rst->pin, pex->rst->port);
@@ -63,6 +65,13 @@ void write_pex_register(pex_t* pex, uint8_t addr, uint8_t data) {
     send_data_i2c(addr, I2C_ACK);
     send_data_i2c(data, I2C_ACK);
     send_stop_i2c();
+
+    // keep the GPIO shadow in sync
+    if (addr == PEX_GPIO_A) {
+        pex->gpio = (pex->gpio & 0x00FF) | ((uint16_t) data << 8);
+    } else if (addr == PEX_GPIO_B) {
+        pex->gpio = (pex->gpio & 0xFF00) | data;
+    }
 }
 
 /*
@@ -124,6 +133,37 @@ void set_pex_bank_pair(pex_t* pex, uint8_t addr, uint16_t data){
     send_data_i2c((uint8_t)(data >> 8), I2C_ACK);
     send_data_i2c((uint8_t)(data), I2C_ACK);
     send_stop_i2c();
+
+    if (addr == PEX_GPIO_A) {
+        pex->gpio = data;
+        pex->gpio_valid = 1;
+    }
+}
+
+/*
+Returns the output state of bank A and B (bank A in the high byte)
+Served from the shadow copy if it is valid, otherwise read over I2C
+pex - pointer to the pex device
+*/
+uint16_t get_pex_gpio(pex_t* pex) {
+    if (!pex->gpio_valid) {
+        pex->gpio = get_pex_bank_pair(pex, PEX_GPIO_A);
+        pex->gpio_valid = 1;
+    }
+    return pex->gpio;
+}
+
+/*
+Sets the output state of bank A and B (bank A in the high byte) in one write
+Skipped if the shadow copy shows the device already holds this state
+pex - pointer to the pex device
+data - GPIO state
+*/
+void set_pex_gpio(pex_t* pex, uint16_t data) {
+    if (pex->gpio_valid && pex->gpio == data) {
+        return;
+    }
+    set_pex_bank_pair(pex, PEX_GPIO_A, data);
 }
 
 
@@ -39,18 +39,112 @@ inline int16_t print(char* fmt, ...) {
     return ret;
 }
 
+/*
+Same as print(), but the format string is read from flash (program memory).
+Use the PRINT() macro to place a string literal in flash and print it, which
+keeps it out of SRAM.
+
+str - Format string for the message, in program memory
+variable arguments - To be substituted for format specifiers
+*/
+int16_t print_P(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int16_t ret = vsnprintf_P((char*) print_buf, PRINT_BUF_SIZE, fmt, args);
+    va_end(args);
+
+    send_uart(print_buf, strlen((char*) print_buf));
+    return ret;
+}
+
 /*
 Prints an array of bytes in hex format on the same line.
+Converts the digits directly instead of formatting each byte with print()
 data - pointer to beginning of array
 len - number of bytes in array
 */
 void print_bytes(uint8_t* data, uint16_t len) {
+    static const char hex_digits[] PROGMEM = "0123456789abcdef";
+
     if (len == 0) {
         return;
     }
-    print("%.2x", data[0]);
-    for (uint16_t i = 1; i < len; i++) {
-        print(":%.2x", data[i]);
+    for (uint16_t i = 0; i < len; i++) {
+        if (i > 0) {
+            put_uart_char(':');
+        }
+        put_uart_char(pgm_read_byte(&hex_digits[data[i] >> 4]));
+        put_uart_char(pgm_read_byte(&hex_digits[data[i] & 0x0F]));
     }
-    print("\n");
+    put_uart_char('\n');
+}
+
+/*
+Binary logging
+A frame is built in print_buf (binary and text logging are never interleaved
+within one message), see LOG_BIN_SYNC in uart.h for the layout.
+Use the LOG_* macros instead of calling these directly.
+*/
+
+// Number of bytes in print_buf used by the frame in progress
+uint8_t log_bin_len = 0;
+
+// Starts a frame with the given sync byte
+static void log_bin_begin_sync(uint8_t sync, const char* fmt) {
+    uint16_t addr = (uint16_t) (uintptr_t) fmt;
+
+    print_buf[0] = sync;
+    print_buf[1] = (uint8_t) addr;
+    print_buf[2] = (uint8_t) (addr >> 8);
+    print_buf[3] = 0;
+    log_bin_len = 4;
+}
+
+/*
+Starts a binary log frame
+fmt - format string in SRAM, only its address is sent
+*/
+void log_bin_begin(const char* fmt) {
+    log_bin_begin_sync(LOG_BIN_SYNC, fmt);
+}
+
+/*
+Starts a binary log frame
+fmt - format string in flash, only its address is sent
+*/
+void log_bin_begin_P(const char* fmt) {
+    log_bin_begin_sync(LOG_BIN_SYNC_P, fmt);
+}
+
+/*
+Adds the raw bytes of one argument to the frame, truncated if the frame is full
+arg - pointer to the (promoted) argument value
+size - number of bytes
+*/
+void log_bin_arg(const void* arg, uint8_t size) {
+    for (uint8_t i = 0; i < size && log_bin_len < PRINT_BUF_SIZE; i++) {
+        print_buf[log_bin_len] = ((const uint8_t*) arg)[i];
+        log_bin_len++;
+    }
+}
+
+/*
+Fills in the payload length and sends the frame
+The frame is sent whole or not at all, so a full TX buffer can't leave a frame
+with fewer bytes than its header says
+*/
+void log_bin_end(void) {
+    print_buf[3] = log_bin_len - 4;
+    send_uart_frame(print_buf, log_bin_len);
+}
+
+/*
+Sends a frame of raw bytes (format address 0)
+data - pointer to beginning of array
+len - number of bytes in array
+*/
+void log_bin_bytes(const uint8_t* data, uint8_t len) {
+    log_bin_begin(NULL);
+    log_bin_arg(data, len);
+    log_bin_end();
 }
@@ -13,6 +13,9 @@ user-friendly terminal).
 
 // Maximum number of characters the UART RX buffer can store
 #define UART_MAX_RX_BUF_SIZE    50
+// Number of characters the UART TX ring buffer can store (minus one)
+// Must be a power of 2
+#define UART_TX_BUF_SIZE        64
 #define UBRR    (uint16_t)(UART_F_IO/16/UART_DEF_BAUD_RATE - 1)
 
 // Buffer of received characters
@@ -27,6 +30,17 @@ uint8_t _uart_rx_cb_nop(const uint8_t* c, uint8_t len) {
 // Global RX callback function
 uart_rx_cb_t uart_rx_cb = _uart_rx_cb_nop;
 
+// Ring buffer of characters waiting to be sent by the UDRE interrupt
+volatile uint8_t uart_tx_buf[UART_TX_BUF_SIZE];
+// Index of the next character to add
+volatile uint8_t uart_tx_head;
+// Index of the next character to send
+volatile uint8_t uart_tx_tail;
+// Number of characters discarded because the TX buffer was full
+volatile uint16_t uart_tx_drop_count;
+// What to do when the TX buffer is full
+uart_tx_policy_t uart_tx_policy = UART_TX_BLOCK;
+
 
 /*
 Initializes the UART library
@@ -50,19 +64,53 @@ void init_uart(void) {
     // Set default (no operation) RX callback
     uart_rx_cb = _uart_rx_cb_nop;
 
+    // reset TX buffer, block by default so no messages are lost
+    uart_tx_head = 0;
+    uart_tx_tail = 0;
+    uart_tx_drop_count = 0;
+    uart_tx_policy = UART_TX_BLOCK;
+
     // globally enable interrupts
     sei();
 }
 
 /*
 Sends one character over UART (TX)
-Waits for the UDRE bit to go high to indicate that data can be written
+Adds the character to the TX buffer and returns, the UDRE interrupt sends it
+If the buffer is full the character is either dropped or this waits for room,
+depending on the policy set with set_uart_tx_policy()
 c - character to send
 */
 void put_uart_char(uint8_t c) {
-    uint16_t timeout = UINT16_MAX;
-    while (!(UCSR0A & _BV(UDRE0)) && timeout--);
-    UDR0 = c;
+    // The interrupt can't drain the buffer if interrupts are disabled
+    uint8_t irq_enabled = SREG & _BV(SREG_I);
+
+    while (1) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            uint8_t next = (uart_tx_head + 1) & (UART_TX_BUF_SIZE - 1);
+
+            if (next != uart_tx_tail) {
+                uart_tx_buf[uart_tx_head] = c;
+                uart_tx_head = next;
+                // Enable the data register empty interrupt to start sending
+                UCSR0B |= _BV(UDRIE0);
+                return;
+            }
+
+            if (uart_tx_policy == UART_TX_DROP) {
+                uart_tx_drop_count++;
+                return;
+            }
+
+            if (!irq_enabled) {
+                // Make room by sending the oldest character directly
+                uint16_t timeout = UINT16_MAX;
+                while (!(UCSR0A & _BV(UDRE0)) && timeout--);
+                UDR0 = uart_tx_buf[uart_tx_tail];
+                uart_tx_tail = (uart_tx_tail + 1) & (UART_TX_BUF_SIZE - 1);
+            }
+        }
+    }
 }
 
 /*
@@ -86,6 +134,37 @@ void send_uart(const uint8_t* msg, uint8_t len) {
     }
 }
 
+/*
+Sends a sequence of characters that is only useful whole, e.g. a binary log
+frame whose header holds its length.
+Under UART_TX_DROP the whole sequence is dropped if the TX buffer doesn't have
+room for all of it, instead of losing characters from the middle. Under
+UART_TX_BLOCK this is the same as send_uart().
+msg - pointer to start of array
+len - number of characters, less than UART_TX_BUF_SIZE
+*/
+void send_uart_frame(const uint8_t* msg, uint8_t len) {
+    if (uart_tx_policy == UART_TX_BLOCK) {
+        send_uart(msg, len);
+        return;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint8_t space = (uart_tx_tail - uart_tx_head - 1) & (UART_TX_BUF_SIZE - 1);
+        if (len > space) {
+            uart_tx_drop_count += len;
+            return;
+        }
+
+        for (uint8_t i = 0; i < len; i++) {
+            uart_tx_buf[uart_tx_head] = msg[i];
+            uart_tx_head = (uart_tx_head + 1) & (UART_TX_BUF_SIZE - 1);
+        }
+        // Enable the data register empty interrupt to start sending
+        UCSR0B |= _BV(UDRIE0);
+    }
+}
+
 /*
 Sets the callback function that will be called when UART receives data.
 cb - callback function
@@ -102,6 +181,33 @@ void set_uart_rx_cb(uart_rx_cb_t cb) {
     uart_rx_cb = cb;
 }
 
+/*
+Sets what happens to a character when the TX buffer is full.
+policy - UART_TX_BLOCK waits for room (default), UART_TX_DROP discards it and
+         increments the drop counter
+*/
+void set_uart_tx_policy(uart_tx_policy_t policy) {
+    uart_tx_policy = policy;
+}
+
+/*
+Gets the policy set with set_uart_tx_policy().
+*/
+uart_tx_policy_t get_uart_tx_policy(void) {
+    return uart_tx_policy;
+}
+
+/*
+Gets the number of characters discarded because the TX buffer was full.
+*/
+uint16_t get_uart_tx_drop_count(void) {
+    uint16_t count = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        count = uart_tx_drop_count;
+    }
+    return count;
+}
+
 /*
 Gets the number of characters that are currently in the UART RX buffer but have
 not been processed yet.
@@ -162,3 +268,16 @@ ISR(USART_RX_vect) {
         }
     }
 }
+
+// Interrupt handler that will be called when the UART can accept the next
+// character to send
+ISR(USART_UDRE_vect) {
+    if (uart_tx_head == uart_tx_tail) {
+        // Nothing left to send, stop the interrupt until the next character
+        UCSR0B &= ~_BV(UDRIE0);
+        return;
+    }
+
+    UDR0 = uart_tx_buf[uart_tx_tail];
+    uart_tx_tail = (uart_tx_tail + 1) & (UART_TX_BUF_SIZE - 1);
+}
@@ -16,12 +16,26 @@ void get_channel_readings(){
       data = get_opt_sensor_reading(i, PAY_OPTICAL);
       gain = (uint8_t)(data >> 24);
       time = (uint8_t)((data >> 16) & 0x00FF);
-      print("Sensor,%2d, Gain:,%02X, Time:,%02X, Value:,%lu,\n", i, gain, time, (data & 0x0000FFFF));
+      PRINT("Sensor,%2d, Gain:,%02X, Time:,%02X, Value:,%lu,\n", i, gain, time, (data & 0x0000FFFF));
     }
-	  print("\n");
+	  PRINT("\n");
   }
 }
 
+// set by rx_command(), the capture needs interrupts so it runs in the main loop
+volatile uint8_t capture_requested = 0;
+
+// capture and print the board current as the sensor rail switches off and on
+void capture_sensor_rail(){
+  arm_power_capture();
+  enter_sleep_mode();
+  print_power_capture();
+
+  arm_power_capture();
+  enter_normal_mode();
+  print_power_capture();
+}
+
 uint8_t rx_command(const uint8_t* buf, uint8_t len){
   static uint8_t echo = 0;
   uint8_t recieved;
@@ -32,7 +46,7 @@ uint8_t rx_command(const uint8_t* buf, uint8_t len){
         if (buf[i] == 13){
           // recieved CR character
           echo = 0;
-		  print("--\n");
+		  PRINT("--\n");
         }
     }
   } if (!echo) {
@@ -41,13 +55,15 @@ uint8_t rx_command(const uint8_t* buf, uint8_t len){
     if (recieved == 0){
       //sweep the channels on bank A1
       get_channel_readings();
+    } else if (recieved == 1){
+      capture_requested = 1;
     } else if (recieved == 7){
-      print("--\n");
+      PRINT("--\n");
       echo = 1;
     } else if ((buf[0] == 10) | (buf[0] == 13)){
       // carriage return or line feed character
     } else {
-      print("--Invalid command: %02X\n", buf[0]);
+      PRINT("--Invalid command: %02X\n", buf[0]);
     }
   }
   return len;
@@ -57,7 +73,12 @@ int main(void) {
 	init_board();
 	set_uart_rx_cb(rx_command);
 
-	while (1);
+	while (1){
+    if (capture_requested){
+      capture_requested = 0;
+      capture_sensor_rail();
+    }
+  }
 }
 
 
@@ -9,7 +9,7 @@
 
 void sequence(void){
     while(1){
-		for (uint8_t i = 0; i < 32; i++){
+		for (uint8_t i = 0; i < OPT_WELL_COUNT; i++){
 			set_led(i, PAY_OPTICAL, 1);
             set_led(i, PAY_LED, 1);
 			_delay_ms(500);
@@ -21,7 +21,7 @@ void sequence(void){
 
 void sequence_2(void){
     while(1){
-		for (uint8_t i = 0; i < 32; i++){
+		for (uint8_t i = 0; i < OPT_WELL_COUNT; i++){
 			set_led(i, PAY_OPTICAL, 1);
             _delay_ms(200);
             set_led(i, PAY_OPTICAL, 0);
@@ -51,9 +51,11 @@ void sequence_3(void){
 
 void all(void){
     while(1){
-        all_on();
+        all_on(PAY_OPTICAL);
+        all_on(PAY_LED);
         _delay_ms(1000);
-        all_off();
+        all_off(PAY_OPTICAL);
+        all_off(PAY_LED);
         _delay_ms(1000);
     }
 }
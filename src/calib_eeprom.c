@@ -0,0 +1,164 @@
+/*
+    Wear-levelled storage of the well calibration in EEPROM
+
+    Records are written one byte per EE_READY interrupt, so a save never
+    blocks the main loop (each byte takes about 3.4 ms). Bytes that already
+    hold the right value are skipped, so a record rewritten with mostly the
+    same settings only wears the bytes that changed
+ */
+
+#include "calib_eeprom.h"
+
+// Slot and sequence number of the next record
+uint8_t calib_eeprom_slot = 0;
+uint16_t calib_eeprom_seq = 0;
+
+// Set when well_calib changed since the last record was started
+bool calib_eeprom_dirty = false;
+
+// Record being written from the EE_READY interrupt
+uint16_t calib_eeprom_write_addr = 0;
+uint16_t calib_eeprom_write_seq = 0;
+volatile uint16_t calib_eeprom_write_pos = 0;
+volatile uint16_t calib_eeprom_write_crc = 0;
+
+/*
+CRC of a record before its first byte, includes the well count so that records
+of a different board layout are never loaded
+*/
+static uint16_t calib_eeprom_crc_init(void){
+    return _crc16_update(0xFFFF, OPT_WELL_COUNT);
+}
+
+/*
+EEPROM address of a byte of the record in slot
+*/
+static uint16_t calib_eeprom_addr(uint8_t slot, uint16_t offset){
+    return (uint16_t)slot * CALIB_EEPROM_RECORD_SIZE + offset;
+}
+
+/*
+Load the newest valid record into well_calib
+Returns false and leaves well_calib unchanged if there is none, e.g. on a blank
+EEPROM or after the well count changed
+*/
+bool load_well_calibration(void){
+    bool found = false;
+    uint8_t newest = 0;
+    uint16_t newest_seq = 0;
+
+    for (uint8_t slot = 0; slot < CALIB_EEPROM_SLOTS; slot++){
+        uint16_t seq = eeprom_read_word((const uint16_t*)(uintptr_t)calib_eeprom_addr(slot, 0));
+        if (seq == EEPROM_DEF_WORD){
+            continue;   // erased
+        }
+
+        uint16_t crc = calib_eeprom_crc_init();
+        for (uint16_t i = 0; i < CALIB_EEPROM_CRC_OFFSET; i++){
+            crc = _crc16_update(crc, eeprom_read_byte((const uint8_t*)(uintptr_t)calib_eeprom_addr(slot, i)));
+        }
+        if (crc != eeprom_read_word((const uint16_t*)(uintptr_t)calib_eeprom_addr(slot, CALIB_EEPROM_CRC_OFFSET))){
+            continue;   // never completed or corrupted
+        }
+
+        // sequence numbers wrap, a newer record is less than half the range ahead
+        if (!found || ((int16_t)(seq - newest_seq) > 0)){
+            found = true;
+            newest = slot;
+            newest_seq = seq;
+        }
+    }
+
+    if (!found){
+        calib_eeprom_slot = 0;
+        calib_eeprom_seq = 0;
+        return false;
+    }
+
+    eeprom_read_block(well_calib, (const void*)(uintptr_t)calib_eeprom_addr(newest, 2),
+        CALIB_EEPROM_DATA_SIZE);
+
+    calib_eeprom_slot = (newest + 1) % CALIB_EEPROM_SLOTS;
+    calib_eeprom_seq = newest_seq + 1;
+    if (calib_eeprom_seq == EEPROM_DEF_WORD){
+        calib_eeprom_seq = 0;
+    }
+    return true;
+}
+
+/*
+Mark well_calib as changed, it is written by the next flush_well_calibration()
+*/
+void save_well_calibration(void){
+    calib_eeprom_dirty = true;
+}
+
+/*
+Start writing well_calib to the next slot if it changed since the last record
+Returns immediately, nothing is started while a record is still being written
+Changes made during a write are picked up by the CRC as the bytes go out and
+leave well_calib marked as changed, so they get a record of their own
+*/
+void flush_well_calibration(void){
+    if (!calib_eeprom_dirty || well_calibration_busy()){
+        return;
+    }
+    calib_eeprom_dirty = false;
+
+    calib_eeprom_write_addr = calib_eeprom_addr(calib_eeprom_slot, 0);
+    calib_eeprom_write_seq = calib_eeprom_seq;
+    calib_eeprom_write_pos = 0;
+    calib_eeprom_write_crc = calib_eeprom_crc_init();
+
+    calib_eeprom_slot = (calib_eeprom_slot + 1) % CALIB_EEPROM_SLOTS;
+    calib_eeprom_seq++;
+    if (calib_eeprom_seq == EEPROM_DEF_WORD){
+        calib_eeprom_seq = 0;
+    }
+
+    // fires whenever the EEPROM is ready for the next byte
+    EECR |= _BV(EERIE);
+}
+
+/*
+Returns true while a record is being written
+*/
+bool well_calibration_busy(void){
+    return (EECR & _BV(EERIE)) != 0;
+}
+
+ISR(EE_READY_vect){
+    uint16_t pos = calib_eeprom_write_pos;
+    uint16_t crc = calib_eeprom_write_crc;
+    uint8_t data = 0;
+
+    if (pos >= CALIB_EEPROM_RECORD_SIZE){
+        // record complete
+        EECR &= ~_BV(EERIE);
+        return;
+    }
+
+    if (pos < 2){
+        data = (calib_eeprom_write_seq >> (pos * 8)) & 0xFF;
+    } else if (pos < CALIB_EEPROM_CRC_OFFSET){
+        data = ((const uint8_t*)well_calib)[pos - 2];
+    } else {
+        data = (crc >> ((pos - CALIB_EEPROM_CRC_OFFSET) * 8)) & 0xFF;
+    }
+    if (pos < CALIB_EEPROM_CRC_OFFSET){
+        calib_eeprom_write_crc = _crc16_update(crc, data);
+    }
+    calib_eeprom_write_pos = pos + 1;
+
+    EEAR = calib_eeprom_write_addr + pos;
+    EECR |= _BV(EERE);
+    if (EEDR == data){
+        // already there, the interrupt fires again straight away
+        return;
+    }
+
+    EEDR = data;
+    // EEPE must be set within 4 cycles of EEMPE, interrupts are already off
+    EECR |= _BV(EEMPE);
+    EECR |= _BV(EEPE);
+}
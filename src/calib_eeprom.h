@@ -0,0 +1,38 @@
+#ifndef CALIB_EEPROM_H
+#define CALIB_EEPROM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <util/crc16.h>
+#include <utilities/utilities.h>
+#include "optical.h"
+
+/*
+The well calibration (well_calib) is kept in a ring of records spread over the
+whole EEPROM. Each save goes to the slot after the newest record, so wear is
+spread evenly over the slots, and a save cut short by a reset or brown-out only
+loses that record
+
+Record layout:
+    sequence number (2 bytes, LSB first), never EEPROM_DEF_WORD
+    well_calib (one byte per setting)
+    CRC-16 (2 bytes, LSB first) of the well count, sequence number and data
+*/
+#define CALIB_EEPROM_DATA_SIZE      (PAY_BOARD_COUNT * OPT_WELL_COUNT)
+#define CALIB_EEPROM_CRC_OFFSET     (2 + CALIB_EEPROM_DATA_SIZE)
+#define CALIB_EEPROM_RECORD_SIZE    (CALIB_EEPROM_CRC_OFFSET + 2)
+#define CALIB_EEPROM_SLOTS          ((E2END + 1) / CALIB_EEPROM_RECORD_SIZE)
+
+#if CALIB_EEPROM_SLOTS < 2
+#error "The EEPROM must hold at least two calibration records"
+#endif
+
+bool load_well_calibration(void);
+void save_well_calibration(void);
+void flush_well_calibration(void);
+bool well_calibration_busy(void);
+
+#endif
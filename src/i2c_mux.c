@@ -3,9 +3,11 @@
 
 /*
 Initialize the MUX rst
+Resets the MUX so the channel register is in a known state (all disabled)
 */
 void init_mux(mux_t* mux){
     init_output_pin(mux->rst->pin, mux->rst->ddr, 1);
+    reset_mux(mux);
 }
 
 /*
@@ -16,6 +18,8 @@ void reset_mux(mux_t* mux){
     set_pin_low(mux->rst->pin, mux->rst->port);
     _delay_us(1);
     set_pin_high(mux->rst->pin, mux->rst->port);
+    // all channels are disabled after a reset
+    mux->channels = 0x00;
 }
 
 /*
@@ -25,10 +29,26 @@ channel: number from 0-7
 Only designed to enable one channel at a time
 */
 void set_mux_channel(mux_t* mux, uint8_t channel){
+    set_mux_channels(mux, (uint8_t)(_BV(channel)));
+}
+
+/*
+Set the MUX I2C channel register
+mux: pointer to mux_t
+channels: bit n enables channel n
+Skipped if the channels are already set this way
+*/
+void set_mux_channels(mux_t* mux, uint8_t channels){
+    if (mux->channels == channels){
+        return;
+    }
+
     send_start_i2c();
     send_addr_i2c((MUX_CONTROL_BYTE | mux->addr), I2C_WRITE);
-    send_data_i2c((uint8_t)(_BV(channel)), I2C_ACK);
+    send_data_i2c(channels, I2C_ACK);
     send_stop_i2c();
+
+    mux->channels = channels;
 }
 
 /*
@@ -45,6 +65,7 @@ uint8_t get_mux_channels(mux_t* mux){
     read_data_i2c(&data, I2C_NACK);
     send_stop_i2c();
 
+    mux->channels = data;
     return data;
 }
 
@@ -52,10 +73,7 @@ uint8_t get_mux_channels(mux_t* mux){
 Enable all channels on the specified mux
  */
 void enable_all_mux_channels(mux_t* mux){
-    send_start_i2c();
-    send_addr_i2c((MUX_CONTROL_BYTE | mux->addr), I2C_WRITE);
-    send_data_i2c(0xFF, I2C_ACK);
-    send_stop_i2c();
+    set_mux_channels(mux, 0xFF);
 }
 
 /*
@@ -63,8 +81,5 @@ Disable all channels on the specified mux
 Equivalent to resetting the mux, probably slower
  */
 void disable_all_mux_channels(mux_t* mux){
-    send_start_i2c();
-    send_addr_i2c((MUX_CONTROL_BYTE | mux->addr), I2C_WRITE);
-    send_data_i2c(0x00, I2C_ACK);
-    send_stop_i2c();
-}
\ No newline at end of file
+    set_mux_channels(mux, 0x00);
+}
@@ -9,6 +9,9 @@ typedef struct {
     uint8_t addr;
 
     pin_info_t* rst;    
+
+    // Channel register as last written, bit n set if channel n is enabled
+    uint8_t channels;
 } mux_t;
 
 // 7-bit control byte for accessing the mux (see pg 14)
@@ -20,6 +23,7 @@ typedef struct {
 void init_mux(mux_t* mux);
 void reset_mux(mux_t* mux);
 void set_mux_channel(mux_t* mux, uint8_t channel);
+void set_mux_channels(mux_t* mux, uint8_t channels);
 uint8_t get_mux_channels(mux_t* mux);
 void enable_all_mux_channels(mux_t* mux);
 void disable_all_mux_channels(mux_t* mux);
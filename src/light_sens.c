@@ -10,13 +10,19 @@
 Enable the TSL2591 and set default gain and integration time
 */
 void init_light_sensor(light_sensor_t* light_sens){
-    write_light_sense_register(LSENSE_ENABLE, LSENSE_DEF_ENABLE);
-    write_light_sense_register(LSENSE_CONTROL, LSENSE_DEF_CONTROL);
-    // Indicate that the sensor is enabled
-    light_sens->state = LS_ENABLED;
-    // Set the default values
-    light_sens->gain = LS_LOW_GAIN;
-    light_sens->time = LS_200ms;
+    // Device state is unknown, so always write both registers
+    invalidate_light_sensor(light_sens);
+    write_light_sensor_enable(light_sens, LSENSE_DEF_ENABLE);
+    write_light_sensor_control(light_sens, LSENSE_DEF_CONTROL);
+}
+
+/*
+Forget the shadow register values, e.g. when the sensor loses power
+The next write to each register will always go out on the bus
+*/
+void invalidate_light_sensor(light_sensor_t* light_sens){
+    light_sens->enable_reg = LSENSE_SHADOW_INVALID;
+    light_sens->control_reg = LSENSE_SHADOW_INVALID;
 }
 
 /*
@@ -24,8 +30,7 @@ Put the TSL2591 to sleep
 Disables the ALS and internal oscillator
 */
 void sleep_light_sensor(light_sensor_t* light_sens){
-    write_light_sense_register(LSENSE_ENABLE, 0x00);
-    light_sens->state = LS_DISABLED;
+    write_light_sensor_enable(light_sens, 0x00);
 }
 
 /*
@@ -35,8 +40,105 @@ Should be used instead of "init_light_sens" if you wish to save any
 gain or intergation time settings previously written
 */
 void wake_light_sensor(light_sensor_t* light_sens){
-    write_light_sense_register(LSENSE_ENABLE, LSENSE_DEF_ENABLE);
-    light_sens->state = LS_ENABLED;
+    write_light_sensor_enable(light_sens, LSENSE_DEF_ENABLE);
+}
+
+/*
+Start a fresh integration cycle
+Toggles AEN so that AVALID is cleared and the next reading only includes light
+collected from now on
+*/
+void restart_light_sensor(light_sensor_t* light_sens){
+    write_light_sensor_enable(light_sens, LSENSE_PON_ENABLE);
+    write_light_sensor_enable(light_sens, LSENSE_DEF_ENABLE);
+}
+
+/*
+Write the ENABLE register of the TSL2591
+Skipped if the register already holds this value
+*/
+void write_light_sensor_enable(light_sensor_t* light_sens, uint8_t data){
+    if (light_sens->enable_reg == data){
+        return;
+    }
+    write_light_sense_register(LSENSE_ENABLE, data);
+    light_sens->enable_reg = data;
+}
+
+/*
+Write the CONTROL register of the TSL2591
+Skipped if the register already holds this value
+*/
+void write_light_sensor_control(light_sensor_t* light_sens, uint8_t data){
+    if (light_sens->control_reg == data){
+        return;
+    }
+    write_light_sense_register(LSENSE_CONTROL, data);
+    light_sens->control_reg = data;
+}
+
+/*
+Enable every TSL2591 in mask and set default gain and integration time
+light_sens: array of up to 8 sensors, bit n of mask selects light_sens[n]
+The sensors in mask (and only those) must be connected to the bus, they share
+an address so each register is written once for all of them
+*/
+void init_light_sensors(light_sensor_t* light_sens, uint8_t mask){
+    for (uint8_t i = 0; i < 8; i++){
+        if (mask & _BV(i)){
+            invalidate_light_sensor(light_sens + i);
+        }
+    }
+    broadcast_light_sensor_enable(light_sens, mask, LSENSE_DEF_ENABLE);
+    broadcast_light_sensor_control(light_sens, mask, LSENSE_DEF_CONTROL);
+}
+
+/*
+Write the ENABLE register of every TSL2591 in mask at once
+Skipped if all of them already hold this value
+*/
+void broadcast_light_sensor_enable(light_sensor_t* light_sens, uint8_t mask, uint8_t data){
+    uint8_t changed = 0;
+
+    for (uint8_t i = 0; i < 8; i++){
+        if ((mask & _BV(i)) && ((light_sens + i)->enable_reg != data)){
+            changed = 1;
+        }
+    }
+    if (!changed){
+        return;
+    }
+
+    write_light_sense_register(LSENSE_ENABLE, data);
+    for (uint8_t i = 0; i < 8; i++){
+        if (mask & _BV(i)){
+            (light_sens + i)->enable_reg = data;
+        }
+    }
+}
+
+/*
+Write the CONTROL register of every TSL2591 in mask at once
+Skipped if all of them already hold this value
+*/
+void broadcast_light_sensor_control(light_sensor_t* light_sens, uint8_t mask, uint8_t data){
+    uint8_t changed = 0;
+
+    for (uint8_t i = 0; i < 8; i++){
+        if ((mask & _BV(i)) && ((light_sens + i)->control_reg != data)){
+            changed = 1;
+        }
+    }
+    if (!changed){
+        return;
+    }
+
+    write_light_sense_register(LSENSE_CONTROL, data);
+    for (uint8_t i = 0; i < 8; i++){
+        if (mask & _BV(i)){
+            (light_sens + i)->control_reg = data;
+        }
+    }
 }
 
 /*
@@ -71,83 +173,125 @@ uint8_t read_light_sense_register(uint8_t addr){
 
 /*
 Return the values in all the read-only registers of the device
-Must supply a uint8_t* pointer to an array of length 7
+Must supply a uint8_t* pointer to an array of length LSENSE_RO_LEN
 Faster than getting individual channel readings
 */
 void get_light_sense_read_only(uint8_t* data){
     send_start_i2c();
     send_addr_i2c(LSENSE_ADDRESS_READ_ONLY, I2C_READ);
-    for (uint8_t i = 0; i < 6; i++){
+    for (uint8_t i = 0; i < LSENSE_RO_LEN - 1; i++){
         read_data_i2c((data + i), I2C_ACK);
     }
-    read_data_i2c((data + 6), I2C_NACK);
+    read_data_i2c((data + LSENSE_RO_LEN - 1), I2C_NACK);
     send_stop_i2c();
 }
 
 /*
-Get CH0 and CH1 sensor readings
-To get a correct reading of CH1, CH0 must be read first
+Get the CH0 sensor reading
+Polls the read-only block, which returns STATUS, CH0 and CH1 in a single
+transaction, until AVALID is set in the same block as the channel data
+CH1 (infrared only) is read with the block but not used
 See: https://forums.adafruit.com/viewtopic.php?f=19&t=124176 for reference
-CH1 returned in the top two bytes, CH0 returned in the lower two bytes
 */
-void get_light_sensor_readings(light_sensor_t* light_sens){
-    uint8_t reth = 0;
-    uint8_t retl = 0;
-    uint16_t ch0_reading = 0;
-    uint16_t ch1_reading = 0;
+uint16_t get_light_sensor_readings(light_sensor_t* light_sens){
+    uint8_t data[LSENSE_RO_LEN] = {0x00};
 
     uint16_t timeout = UINT16_MAX;
-    while (!(read_light_sense_register(LSENSE_STATUS) & 0x01) && timeout>0){
+    do {
+        get_light_sense_read_only(data);
         timeout--;
-    }
-
-    send_start_i2c();
-    send_addr_i2c(LSENSE_ADDRESS, I2C_WRITE);
-    send_data_i2c((LSENSE_COMMAND_BYTE | LSENSE_C0DATAL), I2C_ACK);
-    send_start_i2c();
-    send_addr_i2c(LSENSE_ADDRESS, I2C_READ);
-    read_data_i2c(&retl, I2C_ACK);
-    read_data_i2c(&reth, I2C_NACK);
-
-    ch0_reading = (uint16_t)((reth << 8) | retl);
-
-    send_start_i2c();
-    send_addr_i2c(LSENSE_ADDRESS, I2C_WRITE);
-    send_data_i2c((LSENSE_COMMAND_BYTE | LSENSE_C1DATAL), I2C_ACK);
-    send_start_i2c();
-    send_addr_i2c(LSENSE_ADDRESS, I2C_READ);
-    read_data_i2c(&retl, I2C_ACK);
-    read_data_i2c(&reth, I2C_NACK);
-    send_stop_i2c();
+    } while (!(data[LSENSE_RO_STATUS] & LSENSE_STATUS_AVALID) && timeout > 0);
 
-    ch1_reading = (uint16_t)((reth << 8) | retl);
+    return (uint16_t)((data[LSENSE_RO_C0DATAH] << 8) | data[LSENSE_RO_C0DATAL]);
+}
 
-    light_sens->last_ch0_reading = ch0_reading;
-    light_sens->last_ch1_reading = ch1_reading;
+/*
+Return the current CONTROL register value, from the shadow copy if known
+*/
+uint8_t read_light_sensor_control(light_sensor_t* light_sens){
+    if (light_sens->control_reg != LSENSE_SHADOW_INVALID){
+        return light_sens->control_reg;
+    }
+    return read_light_sense_register(LSENSE_CONTROL);
 }
 
 /*
-Set the gain bits in the TSL2591 CONTROL register to 
-the gain value stored in the light_sens object
+Set the gain bits in the TSL2591 CONTROL register
 */
-void set_light_sensor_again(light_sensor_t* light_sens){
+void set_light_sensor_again(light_sensor_t* light_sens, light_sensor_again_t gain){
     // read the old control register value
-    uint8_t control_value = read_light_sense_register(LSENSE_CONTROL);
+    uint8_t control_value = read_light_sensor_control(light_sens);
     // insert the new gain bits
-    control_value = (control_value & LSENSE_AGAIN_MASK) | ((light_sens->gain << 4) & ~LSENSE_AGAIN_MASK);
+    control_value = (control_value & LSENSE_AGAIN_MASK) | ((gain << 4) & ~LSENSE_AGAIN_MASK);
     // write back the new register value
-    write_light_sense_register(LSENSE_CONTROL, control_value);
+    write_light_sensor_control(light_sens, control_value);
 }
 
 /*
-Set the integration time bits in the TSL2591 CONTROL register to
-the time value stored in the light_sens object
+Set the integration time bits in the TSL2591 CONTROL register
 */
-void set_light_sensor_atime(light_sensor_t* light_sens){
+void set_light_sensor_atime(light_sensor_t* light_sens, light_sensor_atime_t time){
     // read the old control register value
-    uint8_t control_value = read_light_sense_register(LSENSE_CONTROL);
+    uint8_t control_value = read_light_sensor_control(light_sens);
     // insert the new integration time bits
-    control_value = (control_value & LSENSE_ATIME_MASK) | (light_sens->time & ~LSENSE_ATIME_MASK);
+    control_value = (control_value & LSENSE_ATIME_MASK) | (time & ~LSENSE_ATIME_MASK);
     // write back the new register value
-    write_light_sense_register(LSENSE_CONTROL, control_value);
-}
\ No newline at end of file
+    write_light_sensor_control(light_sens, control_value);
+}
+
+/*
+Set both the gain and integration time bits in the TSL2591 CONTROL register
+with a single write, skipped if the settings haven't changed
+The other CONTROL bits (SRESET) are always written as 0
+The new settings apply from the next integration cycle, use
+restart_light_sensor() to start one
+*/
+void set_light_sensor_again_atime(light_sensor_t* light_sens, light_sensor_setting_t setting){
+    write_light_sensor_control(light_sens, get_light_sensor_control_value(setting));
+}
+
+/*
+Return the gain and integration time the TSL2591 is running with, from the
+CONTROL shadow copy if known
+*/
+light_sensor_setting_t get_light_sensor_setting(light_sensor_t* light_sens){
+    uint8_t control_value = read_light_sensor_control(light_sens);
+    light_sensor_setting_t setting;
+
+    setting.gain = (control_value & ~LSENSE_AGAIN_MASK) >> 4;
+    setting.time = control_value & ~LSENSE_ATIME_MASK;
+    return setting;
+}
+
+/*
+Return the CONTROL register value for a gain and integration time setting
+*/
+uint8_t get_light_sensor_control_value(light_sensor_setting_t setting){
+    return ((setting.gain << 4) & ~LSENSE_AGAIN_MASK) |
+        (setting.time & ~LSENSE_ATIME_MASK);
+}
+
+/*
+Return the relative exposure of a gain and integration time setting
+Counts scale linearly with both, so this is the gain factor multiplied by the
+integration time in units of 100ms (max 9876 * 6, fits in 16 bits)
+*/
+uint16_t get_light_sensor_exposure(light_sensor_setting_t setting){
+    uint16_t factor = LSENSE_LOW_GAIN_FACTOR;
+
+    switch (setting.gain){
+        case LS_MED_GAIN:
+            factor = LSENSE_MED_GAIN_FACTOR;
+            break;
+        case LS_HIGH_GAIN:
+            factor = LSENSE_HIGH_GAIN_FACTOR;
+            break;
+        case LS_MAX_GAIN:
+            factor = LSENSE_MAX_GAIN_FACTOR;
+            break;
+        default:
+            break;
+    }
+
+    return factor * (uint16_t)(setting.time + 1);
+}
@@ -38,20 +38,42 @@ single-block I2C transaction"
 #define LSENSE_C1DATAL          0x16
 #define LSENSE_C1DATAH          0x17
 
+/* READ-ONLY BLOCK */
+// Byte offsets of the registers returned by get_light_sense_read_only()
+#define LSENSE_RO_PID           0
+#define LSENSE_RO_ID            1
+#define LSENSE_RO_STATUS        2
+#define LSENSE_RO_C0DATAL       3
+#define LSENSE_RO_C0DATAH       4
+#define LSENSE_RO_C1DATAL       5
+#define LSENSE_RO_C1DATAH       6
+#define LSENSE_RO_LEN           7
+
+/* STATUS REGISTER BITS */
+// ALS data is valid, an integration cycle has completed since AEN was set
+#define LSENSE_STATUS_AVALID    0x01
+
 /* DEFAULT REGISTER VALUES */
 // Enables the device and powers on the oscillator
 #define LSENSE_DEF_ENABLE       0b00000011
+// Powers on the oscillator with the ALS disabled
+#define LSENSE_PON_ENABLE       0b00000001
 // No reset, low gain, 200ms integration time
 #define LSENSE_DEF_CONTROL      0b00000001
 
+// Shadow register value for an unknown device state, never written to the device
+#define LSENSE_SHADOW_INVALID   0xFF
+
 /* QUALITY OF LIFE DEFINES */ 
 #define LSENSE_AGAIN_MASK   0xCF
 #define LSENSE_ATIME_MASK   0xF8
 
-typedef enum {
-    LS_DISABLED = 0,
-    LS_ENABLED = 1
-} light_sensor_state_t;
+/* GAIN SCALING FACTORS */
+// Typical CH0 gain relative to low gain, see pg 8 of the datasheet
+#define LSENSE_LOW_GAIN_FACTOR      1
+#define LSENSE_MED_GAIN_FACTOR      25
+#define LSENSE_HIGH_GAIN_FACTOR     428
+#define LSENSE_MAX_GAIN_FACTOR      9876
 
 typedef enum {
     LS_LOW_GAIN =   0b00,
@@ -69,21 +91,20 @@ typedef enum {
     LS_600ms =  0b101
 } light_sensor_atime_t;
 
+// Gain and integration time, packed into one byte
 typedef struct {
-    light_sensor_again_t gain;
-    light_sensor_atime_t time;
+    uint8_t gain : 2;   // light_sensor_again_t
+    uint8_t time : 3;   // light_sensor_atime_t
 } light_sensor_setting_t;
 
 // TSL2591 device
+// Readings are returned to the caller, which keeps them in the well table
 typedef struct {
-    // 0 == disabled, 1 == enabled
-    light_sensor_state_t state;
-
-    light_sensor_again_t gain;
-    light_sensor_atime_t time;
-
-    uint16_t last_ch0_reading;
-    uint16_t last_ch1_reading;
+    // Last values written to the ENABLE and CONTROL registers, CONTROL holds
+    // the gain and integration time the device is running with
+    // LSENSE_SHADOW_INVALID if the device state is unknown (e.g. power cycled)
+    uint8_t enable_reg;
+    uint8_t control_reg;
 } light_sensor_t;
 
 /* FUNCTION PROTOTYPES */
@@ -91,11 +112,25 @@ void write_light_sense_register(uint8_t addr, uint8_t data);
 uint8_t read_light_sense_register(uint8_t addr);
 void get_light_sense_read_only(uint8_t* data);
 
+void write_light_sensor_enable(light_sensor_t* light_sens, uint8_t data);
+void write_light_sensor_control(light_sensor_t* light_sens, uint8_t data);
+uint8_t read_light_sensor_control(light_sensor_t* light_sens);
+
+void broadcast_light_sensor_enable(light_sensor_t* light_sens, uint8_t mask, uint8_t data);
+void broadcast_light_sensor_control(light_sensor_t* light_sens, uint8_t mask, uint8_t data);
+
 void init_light_sensor(light_sensor_t* light_sens);
+void init_light_sensors(light_sensor_t* light_sens, uint8_t mask);
+void invalidate_light_sensor(light_sensor_t* light_sens);
 void sleep_light_sensor(light_sensor_t* light_sens);
 void wake_light_sensor(light_sensor_t* light_sens);
-void get_light_sensor_readings(light_sensor_t* light_sens);
-void set_light_sensor_again(light_sensor_t* light_sens);
-void set_light_sensor_atime(light_sensor_t* light_sens);
+void restart_light_sensor(light_sensor_t* light_sens);
+uint16_t get_light_sensor_readings(light_sensor_t* light_sens);
+void set_light_sensor_again(light_sensor_t* light_sens, light_sensor_again_t gain);
+void set_light_sensor_atime(light_sensor_t* light_sens, light_sensor_atime_t time);
+void set_light_sensor_again_atime(light_sensor_t* light_sens, light_sensor_setting_t setting);
+light_sensor_setting_t get_light_sensor_setting(light_sensor_t* light_sens);
+uint8_t get_light_sensor_control_value(light_sensor_setting_t setting);
+uint16_t get_light_sensor_exposure(light_sensor_setting_t setting);
 
 #endif
\ No newline at end of file
@@ -18,10 +18,21 @@ button to work.
 
 #include "power.h"
 #include "optical_spi.h"
+#include "calib_eeprom.h"
 
 int main(void) {
     init_board();
+    // From here on, logging must never stall the SPI request path
+    // The manual tests keep UART_TX_BLOCK so their long dumps aren't cut short
+    set_uart_tx_policy(UART_TX_DROP);
+
     while(1){
         opt_loop_main();
+        // save changed calibration once the queued commands are done
+        if (!opt_has_work()){
+            flush_well_calibration();
+        }
+        // wakes on SPI transfers, and on the ADC, UART and EEPROM interrupts
+        opt_idle();
     }
 }
@@ -1,114 +1,206 @@
+#include <string.h>
 #include "optical.h"
+#include "power.h"
+#include "calib_eeprom.h"
+// Generated from the board description, see tools/gen_board.py
+#include "opt_routes.h"
+#include "opt_devices.h"
 
 // Extra print statements
 bool print_cal_info = false;
 
-/* PORT EXPANDER OBJECTS */
-pex_t OPT_PEX1 = {
-    .addr = OPTICAL_PEX1_ADDR,
-    .rst = NULL
-};
-
-pex_t OPT_PEX2 = {
-    .addr = OPTICAL_PEX2_ADDR,
-    .rst = NULL
-};
-
-pex_t LED_PEX1 = {
-    .addr = LED_PEX1_ADDR,
-    .rst = NULL
-};
-
-pex_t LED_PEX2 = {
-    .addr = LED_PEX2_ADDR,
-    .rst = NULL
-};
-
-/* MUX OBJECTS */
-pin_info_t I2C_MUX1_RST = {
-    .port = &PORTC,
-    .ddr = &DDRC,
-    .pin = PC3
-};
-
-pin_info_t I2C_MUX2_RST = {
-    .port = &PORTC,
-    .ddr = &DDRC,
-    .pin = PC2
-};
-
-pin_info_t I2C_MUX3_RST = {
-    .port = &PORTC,
-    .ddr = &DDRC,
-    .pin = PC1
-};
-
-pin_info_t I2C_MUX4_RST = {
-    .port = &PORTC,
-    .ddr = &DDRC,
-    .pin = PC0
-};
-
-mux_t OPT_MUX1 = {
-    .addr = I2C_MUX1_ADDR,
-    .rst = &I2C_MUX1_RST
-};
-
-mux_t OPT_MUX2 = {
-    .addr = I2C_MUX2_ADDR,
-    .rst = &I2C_MUX2_RST
-};
-
-mux_t OPT_MUX3 = {
-    .addr = I2C_MUX3_ADDR,
-    .rst = &I2C_MUX3_RST
-};
-
-mux_t OPT_MUX4 = {
-    .addr = I2C_MUX4_ADDR,
-    .rst = &I2C_MUX4_RST
-};
+// All muxes and port expanders, in the order of the board description
+// Sensors are numbered mux index * 8 + channel, sensors 0-7 are behind mux 0
+mux_t* opt_muxes[OPT_MUX_COUNT] = OPT_BOARD_MUXES;
+pex_t* opt_pexes[OPT_PEX_COUNT] = OPT_BOARD_PEXES;
 
 /* OPTICAL SENSORS */
 
-light_sensor_t opt_sensors[32];
-well_t wells[32];
+light_sensor_t opt_sensors[OPT_SENSOR_COUNT];
+
+/* WELLS */
+// Stored as one array per field, so each field costs no more than its own size
+// and loops over one field touch contiguous memory
+// well_counts and well_charge change with every reading. well_calib only
+// changes when a calibration converges to new settings, and is the only copy
+// of each well's settings: the sensors' CONTROL shadows only hold what was
+// last written, and a reading's settings are the calibration it was taken with
+
+// CH0 counts of the last reading on each board
+uint16_t well_counts[PAY_BOARD_COUNT][OPT_WELL_COUNT];
+// Charge used by all readings of each well, see read_charge_measurement()
+uint32_t well_charge[OPT_WELL_COUNT];
+// Calibrated settings on each board
+light_sensor_setting_t well_calib[PAY_BOARD_COUNT][OPT_WELL_COUNT];
+// Well mask, set if the last reading was on PAY_OPTICAL, selects the
+// calibration restored on wake up
+uint8_t well_last_board[OPT_WELL_MASK_BYTES];
+
+// Charge used by the last get_opt_sensor_reading()
+uint32_t opt_last_reading_charge = 0;
 
 /*
-Initialize the global array of wells
+Initialize the well table, with the calibration saved in EEPROM if there is one
 */
 void init_wells(void){
-    for (uint8_t i = 0; i < 32; i++){
-        (wells + i)->sensor = (opt_sensors + i);
-        init_well_calibration(wells + i);
+    for (uint8_t i = 0; i < OPT_WELL_COUNT; i++){
+        init_well_calibration(i);
+    }
+    if (load_well_calibration()){
+        LOG_INFO("Calibration loaded from EEPROM\n");
     }
 }
 
 /*
-Initialize the well settings
+Initialize the readings and settings of the well at pos
 */
-void init_well_calibration(well_t* well){
+void init_well_calibration(uint8_t pos){
     light_sensor_setting_t def_settings = {
         LS_LOW_GAIN,
         LS_200ms
     };
-    well->last_led_reading = 0x0000;
-    well->last_opt_reading = 0x0000;
-    well->opt_calib = def_settings;
-    well->led_calib = def_settings;
+    for (uint8_t board = 0; board < PAY_BOARD_COUNT; board++){
+        well_counts[board][pos] = 0;
+        well_calib[board][pos] = def_settings;
+    }
+    well_charge[pos] = 0;
+    set_well_last_board(pos, PAY_OPTICAL);
+}
+
+/*
+Get the board of the last reading of the well at pos
+*/
+pay_board_t get_well_last_board(uint8_t pos){
+    if (OPT_WELL_MASK_TEST(well_last_board, pos)){
+        return PAY_OPTICAL;
+    }
+    return PAY_LED;
+}
+
+/*
+Set the board of the last reading of the well at pos
+*/
+void set_well_last_board(uint8_t pos, pay_board_t board){
+    if (board == PAY_OPTICAL){
+        OPT_WELL_MASK_SET(well_last_board, pos);
+    } else {    // PAY_LED
+        OPT_WELL_MASK_CLEAR(well_last_board, pos);
+    }
 }
 
 /*
 Initialize the global array of optical sensors
 */
 void init_opt_sensors(void){
-    mux_t* mux;
+    for (uint8_t i = 0; i < OPT_MUX_COUNT; i++){
+        select_opt_sensor_group(i, OPT_MUX_ALL_CHANNELS);
+        init_light_sensors(opt_sensors + (i * 8), OPT_MUX_ALL_CHANNELS);
+    }
+    deselect_opt_sensors();
+}
+
+/*
+Write back the last used calibration of every well (for the board of its last
+reading) after the sensors were reset
+Sensors behind the same mux with the same settings are written together, and
+sensors already holding their settings are skipped
+*/
+void restore_opt_sensors_calibration(void){
+    for (uint8_t i = 0; i < OPT_MUX_COUNT; i++){
+        light_sensor_t* mux_sensors = opt_sensors + (i * 8);
+        uint8_t controls[8];
+        uint8_t remaining = 0;
+
+        for (uint8_t pos = 0; pos < OPT_WELL_COUNT; pos++){
+            uint8_t route = get_opt_sensor_route(pos);
+            if ((route >> 3) != i){
+                continue;
+            }
+
+            uint8_t j = route & 0x07;
+            controls[j] = get_light_sensor_control_value(
+                well_calib[get_well_last_board(pos)][pos]);
+            if ((mux_sensors + j)->control_reg != controls[j]){
+                remaining |= _BV(j);
+            }
+        }
 
-    for (uint8_t i = 0; i < 32; i++){
-        get_mux(&mux, i);
-        set_mux_channel(mux, (i % 8));
-        init_light_sensor(opt_sensors + i);
-        disable_all_mux_channels(mux);
+        while (remaining){
+            // group the first remaining channel with all that share its settings
+            uint8_t first = 0;
+            while (!(remaining & _BV(first))){
+                first++;
+            }
+            uint8_t group = 0;
+            for (uint8_t j = first; j < 8; j++){
+                if ((remaining & _BV(j)) && (controls[j] == controls[first])){
+                    group |= _BV(j);
+                }
+            }
+
+            select_opt_sensor_group(i, group);
+            broadcast_light_sensor_control(mux_sensors, group, controls[first]);
+            remaining &= ~group;
+        }
+    }
+    deselect_opt_sensors();
+}
+
+/*
+Route the I2C bus to the sensor at pos
+Every TSL2591 has the same address, so all other muxes are disabled before the
+sensor's channel is enabled. Muxes are only written when their channels need
+to change, so repeated reads of the same well or sequential reads behind the
+same mux cost no extra transactions
+*/
+void select_opt_sensor(uint8_t pos){
+    uint8_t route = get_opt_sensor_route(pos);
+    select_opt_sensor_group(route >> 3, _BV(route & 0x07));
+}
+
+/*
+Get the sensor route of the well at pos: mux index << 3 | mux channel
+*/
+uint8_t get_opt_sensor_route(uint8_t pos){
+    return pgm_read_byte(&opt_sensor_routes[pos]);
+}
+
+/*
+Get the light sensor of the well at pos
+The sensor route is mux index << 3 | channel, which is the sensor number
+*/
+light_sensor_t* get_well_sensor(uint8_t pos){
+    return opt_sensors + get_opt_sensor_route(pos);
+}
+
+/*
+Get the LED route of the well at pos: pex index << 4 | GPIO pin
+*/
+uint8_t get_opt_led_route(uint8_t pos, pay_board_t board){
+    return pgm_read_byte(&opt_led_routes[board][pos]);
+}
+
+/*
+Route the I2C bus to several sensors behind the same mux at once
+mux_num: mux index, sensors (mux_num * 8) to (mux_num * 8 + 7) are behind it
+channels: bit n enables channel n
+Only use this for writes, the selected sensors all answer to the same address
+*/
+void select_opt_sensor_group(uint8_t mux_num, uint8_t channels){
+    for (uint8_t i = 0; i < OPT_MUX_COUNT; i++){
+        if (i != mux_num){
+            disable_all_mux_channels(opt_muxes[i]);
+        }
+    }
+    set_mux_channels(opt_muxes[mux_num], channels);
+}
+
+/*
+Disconnect all sensors from the I2C bus
+*/
+void deselect_opt_sensors(void){
+    for (uint8_t i = 0; i < OPT_MUX_COUNT; i++){
+        disable_all_mux_channels(opt_muxes[i]);
     }
 }
 
@@ -117,167 +209,311 @@ void read_opt_sensor_test(uint8_t pos){
     uint8_t data = 0;
 
     get_mux(&mux, pos);
-    set_mux_channel(mux, (pos % 8));
+    select_opt_sensor(pos);
     data |= read_light_sense_register(LSENSE_ID);
-    print("Sensor %2d, CH0: %02X\n", pos, data);
+    LOG_INFO("Sensor %2d, CH0: %02X\n", pos, data);
     reset_mux(mux);
 }
 
 /*
-Update the global array of wells with a new reading
+Update the well table with a new reading
 */
 void update_well_reading(uint8_t pos, pay_board_t board){
-    if (board == PAY_OPTICAL) {
-        write_opt_sensor_calibration((opt_sensors + pos), (wells + pos)->opt_calib);
-        (wells + pos)->last_opt_reading = get_opt_sensor_reading(pos, board);
-        (wells + pos)->opt_calib = read_opt_sensor_calibration(opt_sensors + pos);
-    } else {    // PAY_LED
-        write_opt_sensor_calibration((opt_sensors + pos), (wells + pos)->led_calib);
-        (wells + pos)->last_led_reading = get_opt_sensor_reading(pos, board);
-        (wells + pos)->led_calib = read_opt_sensor_calibration(opt_sensors + pos);
+    light_sensor_t* light_sens = get_well_sensor(pos);
+
+    set_well_last_board(pos, board);
+    select_opt_sensor(pos);
+    write_opt_sensor_calibration(light_sens, well_calib[board][pos]);
+
+    // the counts are bits[15:0] of the reading
+    well_counts[board][pos] = get_opt_sensor_reading(pos, board) & 0xFFFF;
+
+    light_sensor_setting_t setting = read_opt_sensor_calibration(light_sens);
+    if ((setting.gain != well_calib[board][pos].gain) ||
+            (setting.time != well_calib[board][pos].time)){
+        well_calib[board][pos] = setting;
+        // written back to EEPROM from the main loop
+        save_well_calibration();
     }
 }
 
+/*
+Get the last stored reading of the well at pos for a board, packed as by
+pack_opt_sensor_reading()
+*/
+uint32_t get_well_reading(uint8_t pos, pay_board_t board){
+    return pack_opt_sensor_reading(well_counts[board][pos], well_calib[board][pos]);
+}
+
 /*
 Update the optical sensor with the given calibration
+Only writes CONTROL if the settings changed, the sensor's mux channel must be
+selected. Takes effect from the next integration cycle, use
+restart_light_sensor() to start one
 */
 void write_opt_sensor_calibration(light_sensor_t* light_sens, light_sensor_setting_t setting){
-    sleep_light_sensor(light_sens);
-
-    light_sens->gain = setting.gain;
-    light_sens->time = setting.time;
-
-    set_light_sensor_again(light_sens);
-    set_light_sensor_atime(light_sens);
+    set_light_sensor_again_atime(light_sens, setting);
+}
 
-    // set_light_sensor_again(setting.gain);
-    // set_light_sensor_atime(setting.time);
-    wake_light_sensor(light_sens);
+/*
+Mark the shadow registers of all optical sensors as unknown
+Must be called whenever the sensor power is cycled
+*/
+void invalidate_opt_sensors(void){
+    for (uint8_t i = 0; i < OPT_SENSOR_COUNT; i++){
+        invalidate_light_sensor(opt_sensors + i);
+    }
 }
 
 /*
 Read the current optical sensor settings
 */
 light_sensor_setting_t read_opt_sensor_calibration(light_sensor_t* light_sens){
-    light_sensor_setting_t ret;
-    ret.gain = light_sens->gain;
-    ret.time = light_sens->time;
-    return ret;
+    return get_light_sensor_setting(light_sens);
 }
 
 /*
 Return the sensor reading for channel pos of type meas
+The LED is only lit during the sensor's integration windows
 bits[23:22] are gain
 bits[18:16] are integration time
 bits[15:0] are the data
 */
 uint32_t get_opt_sensor_reading(uint8_t pos, pay_board_t board){
-    mux_t* mux = NULL;
-    uint8_t channel = pos % 8;
     uint32_t ret = 0;
 
-    get_mux(&mux, pos);
+    // integrate the board current over the whole measurement
+    reset_charge_measurement();
+    select_opt_sensor(pos);
 
-    set_led(pos, board, LED_ON);
-    set_mux_channel(mux, channel);
+    uint16_t counts = calibrate_opt_sensor_sensitivity(pos, board);
 
-    calibrate_opt_sensor_sensitivity(opt_sensors + pos); 
+    light_sensor_t* light_sens = get_well_sensor(pos);
+    ret = pack_opt_sensor_reading(counts, read_opt_sensor_calibration(light_sens));
 
-    disable_all_mux_channels(mux);      
-    set_led(pos, board, LED_OFF);
-    ret = opt_sensors[pos].last_ch0_reading | ((uint32_t)(opt_sensors[pos].time) << 16) | ((uint32_t)(opt_sensors[pos].gain) << 22);
+    opt_last_reading_charge = read_charge_measurement();
+    if (well_charge[pos] > UINT32_MAX - opt_last_reading_charge){
+        well_charge[pos] = UINT32_MAX;
+    } else {
+        well_charge[pos] += opt_last_reading_charge;
+    }
 
     return ret;
 }
 
+/*
+Pack a CH0 reading together with the settings it was taken with
+bits[23:22] are gain
+bits[18:16] are integration time
+bits[15:0] are the data
+*/
+uint32_t pack_opt_sensor_reading(uint16_t counts, light_sensor_setting_t setting){
+    return counts | ((uint32_t)(setting.time) << 16) | ((uint32_t)(setting.gain) << 22);
+}
+
+/*
+Take a snapshot of every well on a board using the stored calibration
+All sensors integrate at the same time: each one is started with the settings
+from well_calib, then once the longest integration time has passed they are
+visited again in the same order to collect the results. A full plate costs
+about one integration period plus I2C time instead of one per well
+board: either PAY_OPTICAL or PAY_LED
+led_mask: well mask of the LEDs lit for the whole scan
+out_of_range: well mask set to the wells whose reading fell outside the
+calibrated range, these should be recalibrated with update_well_reading()
+Returns the number of wells out of range
+*/
+uint8_t scan_opt_sensor_plate(pay_board_t board, const uint8_t* led_mask, uint8_t* out_of_range){
+    light_sensor_t* light_sens;
+    light_sensor_setting_t setting;
+    light_sensor_atime_t max_time = LS_100ms;
+    uint8_t out_of_range_count = 0;
+    uint16_t last_reading = 0;
+
+    memset(out_of_range, 0, OPT_WELL_MASK_BYTES);
+
+    set_led_mask(led_mask, board, LED_ON);
+    wait_opt_led_settle(board);
+
+    // start every sensor integrating with its calibrated settings
+    for (uint8_t i = 0; i < OPT_WELL_COUNT; i++){
+        setting = well_calib[board][i];
+        set_well_last_board(i, board);
+        if (setting.time > max_time){
+            max_time = setting.time;
+        }
+
+        light_sens = get_well_sensor(i);
+        select_opt_sensor(i);
+        write_opt_sensor_calibration(light_sens, setting);
+        restart_light_sensor(light_sens);
+    }
+
+    // the first sensor started needs the longest, the sweep back covers the rest
+    for (uint8_t t = LS_100ms; t <= max_time; t++){
+        _delay_ms(100);
+    }
+
+    // collect the results in the same order they were started
+    for (uint8_t i = 0; i < OPT_WELL_COUNT; i++){
+        light_sens = get_well_sensor(i);
+        select_opt_sensor(i);
+        last_reading = get_light_sensor_readings(light_sens);
+        well_counts[board][i] = last_reading;
+        if ((last_reading <= OPT_SENS_LOW_THRES) || (last_reading >= OPT_SENS_HIGH_THRES)){
+            OPT_WELL_MASK_SET(out_of_range, i);
+            out_of_range_count++;
+        }
+    }
+
+    set_led_mask(led_mask, board, LED_OFF);
+
+    return out_of_range_count;
+}
 
 
 /*
-Take readings from the optical sensor and calibrate gain and integration time
-to extract maximum dynamic range
+Run one integration of the sensor at pos with its LED lit
+The LED is switched on and left to settle before the integration is restarted,
+and switched off as soon as the result is valid, so it is never on while the
+sensor is being configured. The sensor must be selected
+Returns the CH0 reading
 */
-void calibrate_opt_sensor_sensitivity(light_sensor_t* light_sens){
-    float last_reading = 0.0;
-    uint8_t calibrated = 0;
+uint16_t integrate_opt_sensor(uint8_t pos, pay_board_t board){
+    light_sensor_t* light_sens = get_well_sensor(pos);
 
-    get_light_sensor_readings(light_sens);
-    last_reading = (float)(light_sens->last_ch0_reading) / (float)(1UL << 16);
+    set_led(pos, board, LED_ON);
+    wait_opt_led_settle(board);
+    // don't use an integration that started before the LED was steady
+    restart_light_sensor(light_sens);
+
+    uint16_t reading = get_light_sensor_readings(light_sens);
+    set_led(pos, board, LED_OFF);
+    return reading;
+}
 
-    if ((last_reading > OPT_SENS_LOW_THRES) && (last_reading < OPT_SENS_HIGH_THRES)){
-        calibrated = 1;
+/*
+Wait for a board's LEDs to reach steady brightness after switching them on
+*/
+void wait_opt_led_settle(pay_board_t board){
+    if (board == PAY_OPTICAL){
+        _delay_us(OPT_LED_SETTLE_US_OPTICAL);
+    } else {    // PAY_LED
+        _delay_us(OPT_LED_SETTLE_US_LED);
     }
+}
 
-    // This should take a maximum of around 8.4s
+/*
+Take readings from the optical sensor at pos and calibrate gain and integration
+time to extract maximum dynamic range
+The first reading is used as a probe to predict the best setting, which is then
+confirmed with one more integration. The confirmation only has to land inside
+the wider hysteresis band, so small errors in the gain model don't cost another
+integration
+The LED for board is only lit during integrations, the sensor must be selected
+Returns the CH0 reading taken with the final setting
+*/
+uint16_t calibrate_opt_sensor_sensitivity(uint8_t pos, pay_board_t board){
+    light_sensor_t* light_sens = get_well_sensor(pos);
+    light_sensor_setting_t setting;
+    light_sensor_setting_t next;
+    uint16_t last_reading = 0;
+    uint16_t low_thres = OPT_SENS_LOW_THRES;
+    uint16_t high_thres = OPT_SENS_HIGH_THRES;
+
+    last_reading = integrate_opt_sensor(pos, board);
+
+    // Normally takes 2 integrations, should never take more than 4
     uint8_t i = 0;
-    for (i = 0; i < OPT_MAX_CALIB_COUNT && !calibrated; i++){
-        // put the device to sleep
-        sleep_light_sensor(light_sens);
-
-        if (last_reading < OPT_SENS_LOW_THRES){
-            if (light_sens->time != LS_600ms){
-                light_sens->time += 1;                  // move to higher integration time
-            } else if (light_sens->gain != LS_MAX_GAIN){
-                light_sens->gain += 1;
-                light_sens->time = LS_200ms;
-            } else {
-                calibrated = 1;                      // nothing we can do, measurement undersaturated
-            }
-        } else if (last_reading > OPT_SENS_HIGH_THRES){
-            if (light_sens->time != LS_200ms){
-                light_sens->time -= 1;                  // move to lower integration time
-            } else if (light_sens->gain != LS_LOW_GAIN){
-                light_sens->gain -= 1;                  
-                light_sens->time = LS_600ms;            
-            } else {
-                calibrated = 1;                                // nothing to do
-            }
-        } else {
+    for (i = 0; i < OPT_MAX_CALIB_COUNT; i++){
+        if ((last_reading > low_thres) && (last_reading < high_thres)){
             // yay we did it! sensor is calibrated
-            calibrated = 1;
+            break;
         }
 
-        set_light_sensor_again(light_sens);
-        set_light_sensor_atime(light_sens);
-        wake_light_sensor(light_sens);
+        setting = read_opt_sensor_calibration(light_sens);
+        next = predict_opt_sensor_setting(setting, last_reading);
+        if ((next.gain == setting.gain) && (next.time == setting.time)){
+            // nothing we can do, measurement is at the end of the range
+            break;
+        }
+
+        // single CONTROL write with the LED off, then integrate with the new settings
+        write_opt_sensor_calibration(light_sens, next);
+        last_reading = integrate_opt_sensor(pos, board);
 
-        get_light_sensor_readings(light_sens);
-        last_reading = (float)(light_sens->last_ch0_reading) / (float)(1UL << 16);
+        low_thres = OPT_SENS_HYST_LOW_THRES;
+        high_thres = OPT_SENS_HYST_HIGH_THRES;
 
-        // print("i = %u, gain = 0x%x, time = 0x%x, reading = 0x%x\n",
-        //     i, light_sens->gain, light_sens->time, light_sens->last_ch0_reading);
+        // LOG_DEBUG("i = %u, gain = 0x%x, time = 0x%x, reading = 0x%x\n",
+        //     i, next.gain, next.time, last_reading);
     }
 
+    if (i >= OPT_MAX_CALIB_COUNT) {
+        LOG_ERROR("Calibration timeout\n");
+    }
     if (print_cal_info) {
-        if (i >= OPT_MAX_CALIB_COUNT) {
-            print("CALIBRATION TIMEOUT\n");
-        }
+        setting = read_opt_sensor_calibration(light_sens);
+        LOG_DEBUG("Calibration: count = %u, gain = 0x%x, time = 0x%x\n",
+            i, setting.gain, setting.time);
+    }
 
-        print("Calibration: ");
-        print("count = %u, gain = 0x%x, time = 0x%x\n",
-            i, light_sens->gain, light_sens->time);
+    return last_reading;
+}
+
+/*
+Predict the sensor setting which brings a reading into the calibrated range
+Counts scale linearly with exposure (gain * integration time), so the reading
+taken at the current setting is scaled to every setting on the ladder
+(200ms - 600ms at each gain) and the highest exposure predicted to stay below
+OPT_SENS_TARGET_THRES is chosen
+A saturated reading is only a lower bound, so it drops to the lowest setting
+reading * exposure is at most 65535 * 59256, so the comparison fits in 32 bits
+*/
+light_sensor_setting_t predict_opt_sensor_setting(light_sensor_setting_t current, uint16_t reading){
+    light_sensor_setting_t lowest = {
+        LS_LOW_GAIN,
+        LS_200ms
+    };
+    light_sensor_setting_t candidate;
+
+    if (reading > OPT_SENS_HYST_HIGH_THRES){
+        return lowest;
     }
 
-    // calling function should pull the last sensor value from light_sens
+    // compare reading * candidate / current against the target without dividing
+    uint32_t target = (uint32_t)OPT_SENS_TARGET_THRES * get_light_sensor_exposure(current);
+
+    for (int8_t gain = LS_MAX_GAIN; gain >= LS_LOW_GAIN; gain--){
+        for (int8_t time = LS_600ms; time >= LS_200ms; time--){
+            candidate.gain = gain;
+            candidate.time = time;
+
+            if ((uint32_t)reading * get_light_sensor_exposure(candidate) < target){
+                return candidate;
+            }
+        }
+    }
+
+    return lowest;
 }
 
 /*
 Initialize all muxes
 */
 void init_all_mux(void){
-    init_mux(&OPT_MUX1);
-    init_mux(&OPT_MUX2);
-    init_mux(&OPT_MUX3);
-    init_mux(&OPT_MUX4);
+    for (uint8_t i = 0; i < OPT_MUX_COUNT; i++){
+        init_mux(opt_muxes[i]);
+    }
 }
 
 /*
 Initialize all the port expanders
 */
 void init_all_pex(void){
-    init_pex_output_low(&OPT_PEX1);
-    init_pex_output_low(&OPT_PEX2);
-    init_pex_output_low(&LED_PEX1);
-    init_pex_output_low(&LED_PEX2);
+    for (uint8_t i = 0; i < OPT_PEX_COUNT; i++){
+        init_pex_output_low(opt_pexes[i]);
+    }
 }
 
 /*
@@ -290,126 +526,166 @@ void init_pex_output_low(pex_t* pex){
 }
 
 /*
-Turns on all the LEDs
+Turns on all the LEDs of a board
 */
 void all_on(pay_board_t board){
-    set_pex_bank_pair(&OPT_PEX1, PEX_GPIO_A, 0xFFFF);
-    set_pex_bank_pair(&OPT_PEX2, PEX_GPIO_A, 0xFFFF);
-    set_pex_bank_pair(&LED_PEX1, PEX_GPIO_A, 0xFFFF);
-    set_pex_bank_pair(&LED_PEX2, PEX_GPIO_A, 0xFFFF);
+    uint8_t pattern[OPT_WELL_MASK_BYTES];
+
+    memset(pattern, 0xFF, sizeof(pattern));
+    set_led_pattern(pattern, board);
 }
 
 /*
-Turns off all the LEDs
+Turns off all the LEDs of a board
 */
 void all_off(pay_board_t board){
-    set_pex_bank_pair(&OPT_PEX1, PEX_GPIO_A, 0);
-    set_pex_bank_pair(&OPT_PEX2, PEX_GPIO_A, 0);
-    set_pex_bank_pair(&LED_PEX1, PEX_GPIO_A, 0);
-    set_pex_bank_pair(&LED_PEX2, PEX_GPIO_A, 0);
+    uint8_t pattern[OPT_WELL_MASK_BYTES];
+
+    memset(pattern, 0x00, sizeof(pattern));
+    set_led_pattern(pattern, board);
+}
+
+/*
+Write the GPIO state of port expander pex_num if it changed
+*/
+static void write_led_pex(uint8_t pex_num, uint16_t gpio_state){
+    if (gpio_state != get_pex_gpio(opt_pexes[pex_num])){
+        // capture the transient if armed
+        trigger_power_capture();
+        set_pex_gpio(opt_pexes[pex_num], gpio_state);
+    }
 }
 
 /*
 Sets the LED at pos to the desired state
-pos: uint8_t between 0 and 31
+pos: well number, less than OPT_WELL_COUNT
 board: either PAY_OPTICAL or PAY_LED
 state: either LED_ON (1) or LED_OFF (0)
 */
 void set_led(uint8_t pos, pay_board_t board, led_state_t state){
-    pex_t* pex = NULL;
+    uint8_t route = get_opt_led_route(pos, board);
+    uint16_t gpio_state = get_pex_gpio(opt_pexes[route >> 4]);
 
-    get_pex(&pex, pos, board);
+    if (state == LED_ON){
+        gpio_state |= _BV(route & 0x0F);
+    } else if (state == LED_OFF){
+        gpio_state &= ~_BV(route & 0x0F);
+    } // else do nothing
 
-    // fudging to correct for hardware layout of PAY-LED
-    if (board == PAY_LED && pos < 16){
-        if (pos < 8){
-            pos += 8;
-        } else {
-            pos -= 8;
-        }
-    }
+    write_led_pex(route >> 4, gpio_state);
+}
 
-    pos %= 16;  // get the pos less than 16
 
-    // read the current GPIO state
-    uint16_t gpio_state = get_pex_bank_pair(pex, PEX_GPIO_A);
+/*
+Sets every LED in mask to the desired state, leaving the others as they are
+Each port expander of the board is written at most once, and not at all if its
+LEDs are already in the desired state
+mask: well mask of the LEDs to change
+board: either PAY_OPTICAL or PAY_LED
+state: either LED_ON (1) or LED_OFF (0)
+*/
+void set_led_mask(const uint8_t* mask, pay_board_t board, led_state_t state){
+    uint8_t board_pexes = get_board_pex_mask(board);
+    uint16_t bits[OPT_PEX_COUNT];
+
+    get_led_pex_bits(mask, board, bits);
+    for (uint8_t i = 0; i < OPT_PEX_COUNT; i++){
+        if (!(board_pexes & _BV(i))){
+            continue;
+        }
+        uint16_t gpio_state = get_pex_gpio(opt_pexes[i]);
 
-    if (state == LED_ON){
-        gpio_state |= _BV(pos);
-    } else if (state == LED_OFF){
-        gpio_state &= ~(_BV(pos));
-    } // else do nothing
+        if (state == LED_ON){
+            gpio_state |= bits[i];
+        } else if (state == LED_OFF){
+            gpio_state &= ~bits[i];
+        } // else do nothing
 
-    // write back the desired LED state
-    set_pex_bank_pair(pex, PEX_GPIO_A, gpio_state);
+        write_led_pex(i, gpio_state);
+    }
 }
 
+/*
+Sets the LEDs of a board to exactly the given pattern, one write per port
+expander
+pattern: well mask of the LEDs to light, all other LEDs are turned off
+board: either PAY_OPTICAL or PAY_LED
+*/
+void set_led_pattern(const uint8_t* pattern, pay_board_t board){
+    uint8_t board_pexes = get_board_pex_mask(board);
+    uint16_t bits[OPT_PEX_COUNT];
+
+    get_led_pex_bits(pattern, board, bits);
+    for (uint8_t i = 0; i < OPT_PEX_COUNT; i++){
+        if (board_pexes & _BV(i)){
+            write_led_pex(i, bits[i]);
+        }
+    }
+}
 
 /*
-Returns the state of the LED at pos
-pos: uint8_t between 0 and 31
+Returns the state of the LED at pos, from the port expander's cached GPIO state
+pos: well number, less than OPT_WELL_COUNT
 board: either PAY_OPTICAL or PAY_LED
 */
 uint8_t get_led(uint8_t pos, pay_board_t board){
     pex_t* pex = NULL;
 
     get_pex(&pex, pos, board);
+    uint16_t gpio_state = get_pex_gpio(pex);
 
-    // fudging to correct for hardware layout of PAY-LED
-    if (board == PAY_LED && pos < 16){
-        if (pos < 8){
-            pos += 8;
-        } else {
-            pos -= 8;
-        }
-    }
+    return (gpio_state >> get_led_pex_pin(pos, board)) & 0x01;
+}
+
+/*
+Get the GPIO pin (bank A in the high byte) driving the LED at pos
+*/
+uint8_t get_led_pex_pin(uint8_t pos, pay_board_t board){
+    return get_opt_led_route(pos, board) & 0x0F;
+}
 
-    // read the current GPIO state
-    uint16_t gpio_state = get_pex_bank_pair(pex, PEX_GPIO_A);
-    uint8_t state = (gpio_state >> (pos % 16)) & 0x01;
+/*
+Get the GPIO bits that drive the LEDs in a well mask, for every port expander
+bits: OPT_PEX_COUNT entries, bits[n] is set to the GPIO bits of opt_pexes[n]
+*/
+void get_led_pex_bits(const uint8_t* mask, pay_board_t board, uint16_t* bits){
+    memset(bits, 0, OPT_PEX_COUNT * sizeof(uint16_t));
 
-    return state;
+    for (uint8_t i = 0; i < OPT_WELL_COUNT; i++){
+        if (OPT_WELL_MASK_TEST(mask, i)){
+            uint8_t route = get_opt_led_route(i, board);
+            bits[route >> 4] |= _BV(route & 0x0F);
+        }
+    }
 }
 
 /*
-Get the corresponding port expander for a board and sensor position
+Get the port expanders driving the LEDs of a board, bit n is set for
+opt_pexes[n]
 */
-void get_pex(pex_t** pex, uint8_t pos, pay_board_t board){
-    
+uint8_t get_board_pex_mask(pay_board_t board){
     if (board == PAY_OPTICAL){
-        if (pos < 16){
-            *pex = &OPT_PEX1;
-        } else {
-            *pex = &OPT_PEX2;
-        }
+        return OPT_BOARD_OPTICAL_PEX_MASK;
     } else {
-        if (pos < 8){
-            *pex = &LED_PEX2;
-        } else if (pos < 16){
-            *pex = &LED_PEX1;
-        } else if (pos < 24){
-            *pex = &LED_PEX2;
-        } else {
-            *pex = &LED_PEX1;
-        }
+        return OPT_BOARD_LED_PEX_MASK;
     }
 }
 
 /*
-Get the corresponding mux for a sensor position */
+Get the corresponding port expander for a board and sensor position
+*/
+void get_pex(pex_t** pex, uint8_t pos, pay_board_t board){
+    *pex = opt_pexes[get_opt_led_route(pos, board) >> 4];
+}
+
+/*
+Get the corresponding mux for a sensor position
+Returns 1 if pos is not a well on this board
+*/
 uint8_t get_mux(mux_t** mux, uint8_t pos){
-    pos = pos/8;
-
-    if (pos == 0){
-        *mux = &OPT_MUX1;
-    } else if (pos == 1){
-        *mux = &OPT_MUX2;
-    } else if (pos == 2){
-        *mux = &OPT_MUX3;
-    } else if (pos == 3){
-        *mux = &OPT_MUX4;
-    } else {
+    if (pos >= OPT_WELL_COUNT){
         return 1;
     }
+    *mux = opt_muxes[get_opt_sensor_route(pos) >> 3];
     return 0;
 }
@@ -8,32 +8,65 @@
 #include <i2c/i2c.h>
 #include "i2c_mux.h"
 #include "light_sens.h"
-
-/* PORT EXPANDER ADDRESSES (HARDWARE) */
-#define OPTICAL_PEX1_ADDR       0b001
-#define OPTICAL_PEX2_ADDR       0b010
-#define LED_PEX1_ADDR           0b011
-#define LED_PEX2_ADDR           0b100
-
-/* I2C MUX ADDRESSES (HARDWARE) */
-#define I2C_MUX1_ADDR           0b000
-#define I2C_MUX2_ADDR           0b011
-#define I2C_MUX3_ADDR           0b010
-#define I2C_MUX4_ADDR           0b100
+// Generated from the board description, see tools/gen_board.py
+#include "opt_board.h"
+
+/* BOARD DIMENSIONS */
+// Set by the board description (make BOARD=...)
+#define OPT_WELL_COUNT          OPT_BOARD_WELL_COUNT
+// Number of muxes, each one has 8 sensors behind it
+#define OPT_MUX_COUNT           OPT_BOARD_MUX_COUNT
+// Number of port expanders driving LEDs, on both boards
+#define OPT_PEX_COUNT           OPT_BOARD_PEX_COUNT
+// Sensors are numbered mux index * 8 + channel, whether or not a well uses them
+#define OPT_SENSOR_COUNT        (OPT_MUX_COUNT * 8)
+
+// The SPI well field is 7 bits, board pex masks are 8 bits and the TCA9548
+// has 3 address pins (sensor loops also use 8 bit indexes)
+// Same limits as tools/gen_board.py
+#if OPT_WELL_COUNT > 128
+#error "At most 128 wells can be addressed over SPI"
+#endif
+#if OPT_MUX_COUNT > 8
+#error "At most 8 muxes are supported"
+#endif
+#if OPT_PEX_COUNT > 8
+#error "At most 8 port expanders are supported"
+#endif
+
+// Well masks are byte arrays of OPT_WELL_MASK_BYTES, well n is bit (n % 8) of
+// byte (n / 8)
+#define OPT_WELL_MASK_BYTES             ((OPT_WELL_COUNT + 7) / 8)
+#define OPT_WELL_MASK_TEST(mask, pos)   ((mask)[(pos) >> 3] & _BV((pos) & 0x07))
+#define OPT_WELL_MASK_SET(mask, pos)    ((mask)[(pos) >> 3] |= _BV((pos) & 0x07))
+#define OPT_WELL_MASK_CLEAR(mask, pos)  ((mask)[(pos) >> 3] &= ~_BV((pos) & 0x07))
+
+// Channel mask enabling every sensor behind a mux
+#define OPT_MUX_ALL_CHANNELS    0xFF
 
 /* CALIBRATION DEFINES */
+// thresholds are CH0 counts, given as a percentage of the 16 bit full scale
+#define OPT_SENS_COUNTS(percent)     ((uint16_t)(((uint32_t)(percent) << 16) / 100))
+
 // hysteresis thresholds, to stop it from calibrating when it's at the edge
-#define OPT_SENS_HYST_LOW_THRES      0.05
-#define OPT_SENS_HYST_HIGH_THRES     0.95
+#define OPT_SENS_HYST_LOW_THRES      OPT_SENS_COUNTS(5)
+#define OPT_SENS_HYST_HIGH_THRES     OPT_SENS_COUNTS(95)
 
-#define OPT_SENS_LOW_THRES           0.1
-#define OPT_SENS_HIGH_THRES          0.9
+#define OPT_SENS_LOW_THRES           OPT_SENS_COUNTS(10)
+#define OPT_SENS_HIGH_THRES          OPT_SENS_COUNTS(90)
+
+// predicted reading to aim for, leaves room for error in the gain ratios
+#define OPT_SENS_TARGET_THRES        OPT_SENS_COUNTS(70)
 
 // Maximum number of times to run the calibration algorithm
 // Should be 20, but add one because running it 20 times is valid, 21 would be
 // a timeout
 #define OPT_MAX_CALIB_COUNT 21
 
+// Time for an LED to reach steady brightness after it is switched on, in us
+#define OPT_LED_SETTLE_US_OPTICAL   500
+#define OPT_LED_SETTLE_US_LED       200
+
 
 /* QUALITY OF LIFE DEFINES */
 typedef enum {
@@ -41,47 +74,84 @@ typedef enum {
     PAY_OPTICAL = 1      // fluorescence
 } pay_board_t;
 
+// Number of boards, per-board well arrays are indexed by pay_board_t
+#define PAY_BOARD_COUNT     2
+
+/* SRAM BUDGET */
+// Bytes per well: well_counts and well_calib for each board, and well_charge
+#define OPT_WELL_SRAM_BYTES     (PAY_BOARD_COUNT * 3 + 4)
+// Bytes per sensor: the light_sensor_t register shadows
+#define OPT_SENSOR_SRAM_BYTES   2
+// Well masks: well_last_board and opt_scan_out_of_range for each board
+#define OPT_MASK_SRAM_BYTES     ((1 + PAY_BOARD_COUNT) * OPT_WELL_MASK_BYTES)
+// Everything else that is statically allocated (SPI queues, UART buffers,
+// print_buf, power_capture_buf, device objects), about 560 B, rounded up
+#define OPT_FIXED_SRAM_BYTES    640
+// Stack for the deepest path, vsnprintf() from a log call under an interrupt
+#define OPT_STACK_SRAM_BYTES    384
+
+#define OPT_TABLE_SRAM_BYTES    (OPT_WELL_COUNT * OPT_WELL_SRAM_BYTES + \
+    OPT_SENSOR_COUNT * OPT_SENSOR_SRAM_BYTES + OPT_MASK_SRAM_BYTES)
+
+#if OPT_TABLE_SRAM_BYTES + OPT_FIXED_SRAM_BYTES + OPT_STACK_SRAM_BYTES > RAMEND - RAMSTART + 1
+#error "The well tables of this board don't fit in SRAM"
+#endif
+
 typedef enum {
     LED_ON  = 1,
     LED_OFF = 0
 } led_state_t;
 
-typedef struct {
-    // calibration settings
-    light_sensor_setting_t opt_calib;
-    light_sensor_setting_t led_calib;
-
-    // last set of readings
-    uint32_t last_opt_reading;
-    uint32_t last_led_reading;
-
-    // sensor struct
-    light_sensor_t* sensor;
-} well_t;
-
 /* EXTERNALLY AVAILABLE VARIABLES */
 extern bool print_cal_info;
-extern well_t wells[];
+extern uint32_t opt_last_reading_charge;
+
+// Well table, one array per field indexed by well number (see optical.c)
+extern uint16_t well_counts[PAY_BOARD_COUNT][OPT_WELL_COUNT];
+extern uint32_t well_charge[OPT_WELL_COUNT];
+extern light_sensor_setting_t well_calib[PAY_BOARD_COUNT][OPT_WELL_COUNT];
+extern uint8_t well_last_board[OPT_WELL_MASK_BYTES];
 
 
 
 /* FUNCTION PROTOTYPES */
 void init_wells(void);
-void init_well_calibration(well_t* well);
+void init_well_calibration(uint8_t pos);
 void read_opt_sensor_test(uint8_t pos);
 void update_well_reading(uint8_t pos, pay_board_t board);
+uint32_t get_well_reading(uint8_t pos, pay_board_t board);
+light_sensor_t* get_well_sensor(uint8_t pos);
+pay_board_t get_well_last_board(uint8_t pos);
+void set_well_last_board(uint8_t pos, pay_board_t board);
 void write_opt_sensor_calibration(light_sensor_t* light_sens, light_sensor_setting_t setting);
 light_sensor_setting_t read_opt_sensor_calibration(light_sensor_t* light_sens);
+void invalidate_opt_sensors(void);
 void init_opt_sensors(void);
+void restore_opt_sensors_calibration(void);
+void select_opt_sensor(uint8_t pos);
+uint8_t get_opt_sensor_route(uint8_t pos);
+uint8_t get_opt_led_route(uint8_t pos, pay_board_t board);
+void select_opt_sensor_group(uint8_t mux_num, uint8_t channels);
+void deselect_opt_sensors(void);
 uint32_t get_opt_sensor_reading(uint8_t pos, pay_board_t board);
-void calibrate_opt_sensor_sensitivity(light_sensor_t* light_sens);
-void all_on();
-void all_off();
+uint32_t pack_opt_sensor_reading(uint16_t counts, light_sensor_setting_t setting);
+uint8_t scan_opt_sensor_plate(pay_board_t board, const uint8_t* led_mask, uint8_t* out_of_range);
+uint16_t integrate_opt_sensor(uint8_t pos, pay_board_t board);
+void wait_opt_led_settle(pay_board_t board);
+uint16_t calibrate_opt_sensor_sensitivity(uint8_t pos, pay_board_t board);
+light_sensor_setting_t predict_opt_sensor_setting(light_sensor_setting_t current, uint16_t reading);
+void all_on(pay_board_t board);
+void all_off(pay_board_t board);
 void init_all_mux(void);
 void init_all_pex(void);
 void init_pex_output_low(pex_t* pex);
 void set_led(uint8_t pos, pay_board_t board, led_state_t state);
+void set_led_mask(const uint8_t* mask, pay_board_t board, led_state_t state);
+void set_led_pattern(const uint8_t* pattern, pay_board_t board);
 uint8_t get_led(uint8_t pos, pay_board_t board);
+uint8_t get_led_pex_pin(uint8_t pos, pay_board_t board);
+void get_led_pex_bits(const uint8_t* mask, pay_board_t board, uint16_t* bits);
+uint8_t get_board_pex_mask(pay_board_t board);
 void get_pex(pex_t** pex, uint8_t pos, pay_board_t board);
 uint8_t get_mux(mux_t** mux, uint8_t pos);
 
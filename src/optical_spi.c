@@ -1,10 +1,51 @@
 /*
     PROTOCOL: to be written
     (see pay > src > optical.c for details)
+
+    Commands are 2 byte frames. They are queued as they arrive and run in
+    order, so PAY-SSM can send several commands back to back. When a response
+    is ready DATA_RDYn goes low, and PAY-SSM clocks out the response bytes;
+    responses come back in the same order as the commands. PAY-SSM must not
+    send commands while DATA_RDYn is low.
+
+    A response is only loaded while SS is high and no command frame is half
+    received. A command frame whose second byte doesn't arrive within
+    SPI_RX_TIMEOUT_MS is discarded, so the next byte starts a new frame.
+    PAY-SSM must wait SPI_SS_LEAD_US after pulling SS low before clocking,
+    so the board can wake from ADC noise reduction sleep.
 */
 
 #include "optical_spi.h"
 
+/* SPI SLAVE STATE */
+// Commands received from PAY-SSM, waiting to be run by opt_loop_main()
+// Each element is the command frame, padded with zeros
+queue_t opt_cmd_queue;
+// Finished responses waiting to be collected by PAY-SSM
+// Each element is the response length followed by the response bytes
+queue_t opt_resp_queue;
+
+// Command frame being received by the SPI interrupt
+volatile uint8_t opt_spi_rx_buf[QUEUE_DATA_SIZE] = {0x00};
+volatile uint8_t opt_spi_rx_count = 0;
+// Set when OPT_SPI_NACK was loaded for the frame being received
+volatile bool opt_spi_rx_nack = false;
+
+// Response being shifted out by the SPI interrupt
+volatile uint8_t opt_spi_tx_buf[SPI_MAX_TX_COUNT] = {0x00};
+// Index of the byte currently loaded in SPDR
+volatile uint8_t opt_spi_tx_index = 0;
+// Number of response bytes, 0 when no response is in progress
+volatile uint8_t opt_spi_tx_count = 0;
+
+// Wells out of range in the last CMD_SCAN_PLATE of each board
+uint8_t opt_scan_out_of_range[PAY_BOARD_COUNT][OPT_WELL_MASK_BYTES] = {{0x00}};
+
+// Number of command frames dropped because the command queue was full or the
+// frame timed out
+volatile uint8_t opt_spi_dropped_count = 0;
+
+
 // Initialize SPI comms as SPI slave, with interrupts enabled
 void init_opt_spi(void){
     // initialize SPI
@@ -13,6 +54,24 @@ void init_opt_spi(void){
     // set DATA_RDYn pin as output high
     DATA_RDYn_DDR |= _BV(DATA_RDYn);    // set direction = output
     opt_set_data_rdy_high();
+
+    init_queue(&opt_cmd_queue);
+    init_queue(&opt_resp_queue);
+    opt_spi_rx_count = 0;
+    opt_spi_rx_nack = false;
+    opt_spi_tx_count = 0;
+    opt_spi_dropped_count = 0;
+
+    // Timer1 times out half received command frames, it only runs while one is
+    // in progress (see opt_start_rx_timeout())
+    power_timer1_enable();
+    TCCR1A = 0x00;
+    TCCR1B = _BV(WGM12);    // CTC mode, stopped
+    OCR1A = SPI_RX_TIMEOUT_TICKS;
+    TIMSK1 = _BV(OCIE1A);
+
+    // interrupt on every completed SPI transfer
+    SPCR |= _BV(SPIE);
 }
 
 // set DATA_RDYn low
@@ -27,87 +86,253 @@ void opt_set_data_rdy_high(){
 
 
 // to be put in infinite loop in main
+// the SPI interrupt queues command frames, this runs them one at a time in the
+// order they were received. A command is only started when there is room for
+// its response, so PAY-SSM can queue several commands and collect the
+// responses (in the same order) whenever DATA_RDYn goes low
 void opt_loop_main(void){
-    // if SPI transfer if completed
-    if (SPSR & _BV(SPIF)){
-        // SPI data from PAY-SSM
-        uint8_t rx_bytes[2] = {0x00};
-        rx_bytes[0] = SPDR;
-
-        // wait until another SPI transfer is completed
-        // --> aka wait until SPIF is no longer high 
-        uint32_t timeout = 1000;
-        while (!(SPSR & _BV(SPIF)) && timeout>0){
-            timeout--;
-            _delay_ms(1);
-        }
-        if (timeout == 0) {
-            print("TIMEOUT RX second byte\n");
-        }
-        rx_bytes[1] = SPDR;
+    // SPI data from PAY-SSM
+    uint8_t rx_bytes[QUEUE_DATA_SIZE] = {0x00};
 
-        print("SPI RX: ");
-        print_bytes(rx_bytes, 2);
+    opt_start_next_response();
 
-        // now, got both bytes
-        // perform the requested command and send back data if necessary
-        manage_cmd(rx_bytes[0], rx_bytes[1]);
+    if (queue_full(&opt_resp_queue)){
+        return;
     }
-    opt_set_data_rdy_high();
+    if (!dequeue(&opt_cmd_queue, rx_bytes)){
+        return;
+    }
+
+    LOG_DEBUG("SPI RX: ");
+    LOG_DEBUG_BYTES(rx_bytes, SPI_RX_COUNT);
+
+    // perform the requested command and queue the response if necessary
+    manage_cmd(rx_bytes[0], rx_bytes[1]);
+
+    opt_start_next_response();
+}
+
+
+// true if opt_loop_main() has a command to run or a response to load
+// must be called with interrupts disabled to be reliable
+bool opt_has_work(void){
+    if (opt_spi_tx_count == 0 && !queue_empty(&opt_resp_queue)){
+        return true;
+    }
+    if (!queue_empty(&opt_cmd_queue) && !queue_full(&opt_resp_queue)){
+        return true;
+    }
+    return false;
+}
+
+// to be put in the main loop after opt_loop_main()
+// sleeps in idle mode until the next interrupt if there is nothing to do.
+// Idle keeps clk_io running, so the SPI slave still clocks in the first byte of
+// a command and wakes the CPU with SPI_STC_vect, adding no latency. Power-down
+// would stop clk_io and need an oscillator start-up on wake, losing that byte
+// In normal mode the background sampler's ADC interrupt still wakes the CPU
+// every 1 ms (see start_power_sampler()), in sleep mode it is stopped
+void opt_idle(void){
+    set_sleep_mode(SLEEP_MODE_IDLE);
+
+    // check and sleep with interrupts disabled, so an interrupt that queues
+    // work between the check and sleep_cpu() can't be missed (sei() only takes
+    // effect after the next instruction)
+    cli();
+    if (opt_has_work()){
+        sei();
+        return;
+    }
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
 }
 
 
 // depending on cmd_code, does appropriate requested function + return data (if needed)
 void manage_cmd (uint8_t spi_first_byte, uint8_t spi_second_byte){
+    uint8_t pos = 0;
+    pay_board_t board = PAY_OPTICAL;
+
     // if first byte is get_reading, then 2nd byte is well info
-    if (spi_first_byte == CMD_GET_READING){
-        print("Get reading\n");
+    // the _CHARGE commands follow the reading with the charge it used
+    // wells that don't exist on this board are treated as invalid commands
+    if ((spi_first_byte == CMD_GET_READING) || (spi_first_byte == CMD_GET_READING_WIDE) ||
+            (spi_first_byte == CMD_GET_READING_CHARGE) || (spi_first_byte == CMD_GET_READING_CHARGE_WIDE)){
+        bool with_charge = (spi_first_byte == CMD_GET_READING_CHARGE) ||
+            (spi_first_byte == CMD_GET_READING_CHARGE_WIDE);
+        uint8_t len = with_charge ? SPI_CHARGE_TX_COUNT : SPI_TX_COUNT;
+        LOG_INFO("Get reading (charge = %u)\n", with_charge);
 
         // spi_second_byte contains well_info
-        opt_update_reading(spi_second_byte);    // performs reading (3 bytes), stores it in wells[32] of well_t
-        
-        // fetch reading from registers
+        if (!opt_decode_well_info(spi_first_byte, spi_second_byte, &pos, &board)){
+            opt_queue_invalid_response(len);
+            return;
+        }
+        update_well_reading(pos, board);    // performs reading (3 bytes), stores it in the well table
+
+        uint32_t reading = get_well_reading(pos, board);
+        // charge saturates at 24 bits
+        uint32_t charge = opt_last_reading_charge;
+        if (charge > 0xFFFFFF)
+            charge = 0xFFFFFF;
+
+        // the plain reading commands only send the first SPI_TX_COUNT bytes
+        uint8_t tx_bytes[SPI_CHARGE_TX_COUNT] = {
+            (reading >> 16) & 0xFF, (reading >> 8) & 0xFF, reading & 0xFF,
+            (charge >> 16) & 0xFF, (charge >> 8) & 0xFF, charge & 0xFF
+        };
+        opt_queue_response(tx_bytes, len);
+    }
+
+    // snapshot of every well on a board, PAY-SSM then collects the readings with
+    // CMD_GET_LAST_READING and recalibrates the wells out of range with
+    // CMD_GET_READING
+    else if (spi_first_byte == CMD_SCAN_PLATE){
+        LOG_INFO("Scan plate\n");
+        uint8_t led_mask[OPT_WELL_MASK_BYTES];
+        board = (spi_second_byte >> OPT_SCAN_TYPE_BIT) & 0x1;
+
+        memset(led_mask, 0xFF, sizeof(led_mask));
+        opt_transfer_bytes(scan_opt_sensor_plate(board, led_mask,
+            opt_scan_out_of_range[board]));
+    }
+
+    // stored reading of a well, from the last scan or reading command
+    else if (spi_first_byte == CMD_GET_LAST_READING){
+        LOG_INFO("Get last reading\n");
+        if (!opt_decode_well_info(spi_first_byte, spi_second_byte, &pos, &board)){
+            opt_queue_invalid_response(SPI_LAST_READING_TX_COUNT);
+            return;
+        }
+
+        uint32_t reading = get_well_reading(pos, board);
+        uint8_t tx_bytes[SPI_LAST_READING_TX_COUNT] = {
+            (reading >> 16) & 0xFF, (reading >> 8) & 0xFF, reading & 0xFF,
+            OPT_WELL_MASK_TEST(opt_scan_out_of_range[board], pos) ? 1 : 0
+        };
+        opt_queue_response(tx_bytes, sizeof(tx_bytes));
+    }
+
+    // cumulative charge of a well, 4 bytes MSB first
+    else if (spi_first_byte == CMD_GET_WELL_CHARGE){
+        LOG_INFO("Get well charge\n");
+        pos = spi_second_byte & OPT_WIDE_FIELD_MASK;
+        if (pos >= OPT_WELL_COUNT){
+            LOG_ERROR("Invalid well %u\n", pos);
+            opt_queue_invalid_response(SPI_WELL_CHARGE_TX_COUNT);
+            return;
+        }
+        uint32_t charge = well_charge[pos];
+        if ((spi_second_byte >> OPT_CHARGE_CLEAR_BIT) & 0x1)
+            well_charge[pos] = 0;
 
-        uint32_t reading = 0;  
-        if ( ((spi_second_byte >> OPT_TYPE_BIT) & 0x1) == PAY_OPTICAL)    // bit 5 = 1
-            reading = (wells + (spi_second_byte & 0x1F))->last_opt_reading;
-        else // PAY_LED, bit 5 = 1
-            reading = (wells + (spi_second_byte & 0x1F))->last_led_reading;
-        
-        opt_transfer_bytes(reading);       // shifts reading data into SPDR over 3 SPI transmissions
+        uint8_t tx_bytes[SPI_WELL_CHARGE_TX_COUNT] = {
+            (charge >> 24) & 0xFF, (charge >> 16) & 0xFF,
+            (charge >> 8) & 0xFF, charge & 0xFF
+        };
+        opt_queue_response(tx_bytes, sizeof(tx_bytes));
     }
 
     // get power
     else if (spi_first_byte == CMD_GET_POWER){
-        print("Get power\n");
+        LOG_INFO("Get power\n");
+        // answered from the background sampler averages
         uint32_t data = read_raw_power();
         opt_transfer_bytes(data);
+
+        // min/max cover the time since the previous request
+        adc_stats_t curr, volt;
+        get_power_stats(&curr, &volt);
+        LOG_DEBUG("Current: min = %u, max = %u, voltage: min = %u, max = %u\n",
+            curr.min, curr.max, volt.min, volt.max);
+        reset_power_stats();
     }
 
-    else if (spi_first_byte == CMD_ENTER_SLEEP_MODE) {
-        print("Sleep mode\n");
-        enter_sleep_mode();
+    // get power with oversampling, wider response
+    else if (spi_first_byte == CMD_GET_POWER_HIRES){
+        LOG_INFO("Get power (high resolution)\n");
+        uint8_t extra_bits = spi_second_byte & OPT_HIRES_BITS_MASK;
+        bool noise_reduction = (spi_second_byte >> OPT_HIRES_NR_BIT) & 0x1;
+
+        uint16_t voltage = read_adc_oversampled(POWER_VOLT_CHANNEL, extra_bits, noise_reduction);
+        uint16_t current = read_adc_oversampled(POWER_CURR_CHANNEL, extra_bits, noise_reduction);
+
+        uint8_t tx_bytes[SPI_HIRES_TX_COUNT] = {
+            (voltage >> 8) & 0xFF, voltage & 0xFF,
+            (current >> 8) & 0xFF, current & 0xFF
+        };
+        opt_queue_response(tx_bytes, SPI_HIRES_TX_COUNT);
+    }
+
+    // capture the current on the next LED or sensor rail switch
+    else if (spi_first_byte == CMD_ARM_POWER_CAPTURE){
+        LOG_INFO("Arm power capture\n");
+        arm_power_capture();
         opt_transfer_bytes(0);
     }
 
+    // spi_second_byte is the chunk number, samples are sent oldest first
+    else if (spi_first_byte == CMD_READ_POWER_CAPTURE){
+        LOG_INFO("Read power capture\n");
+        uint8_t tx_bytes[1 + SPI_CAPTURE_CHUNK] = {0x00};
+        tx_bytes[0] = get_power_capture_state();
+        read_power_capture(tx_bytes + 1,
+            (uint16_t)spi_second_byte * SPI_CAPTURE_CHUNK, SPI_CAPTURE_CHUNK);
+        opt_queue_response(tx_bytes, sizeof(tx_bytes));
+    }
+
+    else if (spi_first_byte == CMD_ENTER_SLEEP_MODE) {
+        LOG_INFO("Sleep mode\n");
+        // 0 once the rail is off, POWER_RAIL_TIMEOUT if it didn't discharge
+        opt_transfer_bytes(enter_sleep_mode());
+    }
+
     else if (spi_first_byte == CMD_ENTER_NORMAL_MODE) {
-        print("Normal mode\n");
-        enter_normal_mode();
-        opt_transfer_bytes(0);
+        LOG_INFO("Normal mode\n");
+        // 0 once the rail is up, POWER_RAIL_TIMEOUT if it didn't come up
+        opt_transfer_bytes(enter_normal_mode());
     }
 
-    // else invalid command
+    // else invalid command, never queued (NACKed by the SPI interrupt)
 }
 
 
-// calibrate and take well readings
+// splits the well_data byte of a reading command into well number and board
 // well_data[5] - optical density = 0, fluorescent LED = 1
 // well_data[4:0] - well number (0-31)
+// the _WIDE commands and CMD_GET_LAST_READING move the type to bit 7,
+// well_data[6:0] is the well number
+// returns false if the well doesn't exist on this board
+bool opt_decode_well_info(uint8_t cmd, uint8_t well_info, uint8_t* pos, pay_board_t* board){
+    if ((cmd == CMD_GET_READING_WIDE) || (cmd == CMD_GET_READING_CHARGE_WIDE) ||
+            (cmd == CMD_GET_LAST_READING)){
+        *pos = well_info & OPT_WIDE_FIELD_MASK;
+        *board = (well_info >> OPT_WIDE_TYPE_BIT) & 0x1;
+    } else {
+        *pos = well_info & OPT_FIELD_MASK;
+        *board = (well_info >> OPT_TYPE_BIT) & 0x1;
+    }
+
+    if (*pos >= OPT_WELL_COUNT){
+        LOG_ERROR("Invalid well %u\n", *pos);
+        return false;
+    }
+    return true;
+}
+
+// calibrate and take well readings, well_info is a CMD_GET_READING well_data byte
 void opt_update_reading(uint8_t well_info){
-    update_well_reading((well_info & 0x1F), (well_info >> OPT_TYPE_BIT) & 0x1);
+    uint8_t pos = 0;
+    pay_board_t board = PAY_OPTICAL;
+
+    if (opt_decode_well_info(CMD_GET_READING, well_info, &pos, &board)){
+        update_well_reading(pos, board);
+    }
 }
 
-// sends multiple bytes via SPI, by sequentially shifting
+// queues a 3 byte response for PAY-SSM
 // MSB sent first
 void opt_transfer_bytes(uint32_t data){
     uint8_t tx_bytes[SPI_TX_COUNT] = {0x00};
@@ -116,28 +341,168 @@ void opt_transfer_bytes(uint32_t data){
         tx_bytes[i] = (data >> shift) & 0xFF;
     }
 
-    print("SPI TX: ");
-    print_bytes(tx_bytes, SPI_TX_COUNT);
+    opt_queue_response(tx_bytes, SPI_TX_COUNT);
+}
 
-    for (uint8_t i = 0; i < SPI_TX_COUNT; i++) {
-        // load the next byte of data, ready for SPI transmission out
-        SPDR = tx_bytes[i];
-        opt_set_data_rdy_low();     // signal to PAY to initiate SPI transfer
+// queues a response of up to SPI_MAX_TX_COUNT bytes for PAY-SSM
+// it is sent by opt_start_next_response() once the earlier responses have
+// been collected
+void opt_queue_response(const uint8_t* data, uint8_t len){
+    uint8_t resp[QUEUE_DATA_SIZE] = {0x00};
+
+    if (len > SPI_MAX_TX_COUNT) {
+        len = SPI_MAX_TX_COUNT;
+    }
+
+    LOG_DEBUG("SPI TX: ");
+    LOG_DEBUG_BYTES((uint8_t*) data, len);
+
+    resp[0] = len;
+    for (uint8_t i = 0; i < len; i++) {
+        resp[i + 1] = data[i];
+    }
+
+    if (!enqueue(&opt_resp_queue, resp)) {
+        LOG_ERROR("Response queue full\n");
+    }
+}
+
+// queues a response of len OPT_SPI_INVALID bytes, for a command that can't be
+// run but must still be answered
+void opt_queue_invalid_response(uint8_t len){
+    uint8_t tx_bytes[SPI_MAX_TX_COUNT];
+
+    if (len > SPI_MAX_TX_COUNT) {
+        len = SPI_MAX_TX_COUNT;
+    }
+    for (uint8_t i = 0; i < len; i++) {
+        tx_bytes[i] = OPT_SPI_INVALID;
+    }
+    opt_queue_response(tx_bytes, len);
+}
+
+// loads the oldest finished response for the SPI interrupt to shift out and
+// pulls DATA_RDYn low
+// does nothing while a response is still in progress, while a command frame is
+// half received (its second byte would be taken as a response clock), or while
+// SS is low (a transfer may be in progress and the SPDR write would collide)
+void opt_start_next_response(void){
+    uint8_t resp[QUEUE_DATA_SIZE] = {0x00};
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        if (opt_spi_tx_count > 0 || opt_spi_rx_count > 0) {
+            return;
+        }
+        if (!(OPT_SPI_SS_PIN & _BV(OPT_SPI_SS))) {
+            return;
+        }
+        if (!dequeue(&opt_resp_queue, resp)) {
+            return;
+        }
 
-        // wait until SPI transfer is complete
-        uint32_t timeout = 1000;
-        while (!(SPSR & _BV(SPIF)) && timeout > 0){
-            timeout--;
-            _delay_ms(1);
+        for (uint8_t i = 0; i < resp[0]; i++) {
+            opt_spi_tx_buf[i] = resp[i + 1];
         }
-        if (timeout == 0) {
-            print("TIMEOUT in opt_transfer_bytes\n");
+        opt_spi_tx_index = 0;
+        opt_spi_tx_count = resp[0];
+
+        // load the first byte of data, ready for SPI transmission out
+        SPDR = opt_spi_tx_buf[0];
+        opt_set_data_rdy_low();     // signal to PAY to initiate SPI transfer
+    }
+}
+
+// SPI transfer complete
+// While a response is loaded, each transfer shifts out the next response byte
+// (the byte received from the master is a dummy). Otherwise the received byte
+// belongs to a command frame, and the second byte of the frame clocks out
+// OPT_SPI_ACK if the command will be queued or OPT_SPI_NACK if it is dropped
+// (command queue full or unknown opcode)
+ISR(SPI_STC_vect){
+    // Must read SPDR to clear SPIF bit
+    uint8_t data = SPDR;
+
+    if (opt_spi_tx_count > 0){
+        opt_spi_tx_index++;
+        if (opt_spi_tx_index < opt_spi_tx_count){
+            SPDR = opt_spi_tx_buf[opt_spi_tx_index];
+        } else {
+            opt_spi_tx_count = 0;
+            SPDR = 0x00;
+            opt_set_data_rdy_high();
         }
-        // Must read SPDR to clear SPIF bit or else optical will think it has
-        // received another SPI transfer
-        uint8_t dummy_byte __attribute__((unused)); // Silence unused variable warning
-        dummy_byte = SPDR;
+        return;
     }
 
-    opt_set_data_rdy_high();
+    opt_spi_rx_buf[opt_spi_rx_count] = data;
+    opt_spi_rx_count++;
+
+    if (opt_spi_rx_count < SPI_RX_COUNT){
+        // an unknown opcode would get no response and put every later
+        // response out of step with its command
+        opt_spi_rx_nack = queue_full(&opt_cmd_queue) ||
+            (data < CMD_FIRST) || (data > CMD_LAST);
+        SPDR = opt_spi_rx_nack ? OPT_SPI_NACK : OPT_SPI_ACK;
+        opt_start_rx_timeout();
+        return;
+    }
+
+    opt_stop_rx_timeout();
+    opt_spi_rx_count = 0;
+    SPDR = 0x00;
+    // keep the frame in line with what PAY-SSM was told
+    if (opt_spi_rx_nack || !enqueue(&opt_cmd_queue, (uint8_t*) opt_spi_rx_buf)){
+        opt_spi_dropped_count++;
+    }
+}
+
+// true while PAY-SSM may be clocking a transfer: SS is low, a command frame is
+// half received or a response is waiting to be collected
+// Sleep modes that stop clk_io must not be entered then, the SPI slave needs
+// it to shift bytes
+bool opt_spi_active(void){
+    return !(OPT_SPI_SS_PIN & _BV(OPT_SPI_SS)) || (opt_spi_rx_count > 0) ||
+        (opt_spi_tx_count > 0);
+}
+
+// enables or disables waking the CPU when SS changes, so a sleep mode that
+// stops clk_io is left as soon as PAY-SSM selects the board
+void opt_spi_wake_on_ss(bool enable){
+    if (enable) {
+        PCIFR = _BV(PCIF0);
+        PCMSK0 |= _BV(OPT_SPI_SS_PCINT);
+        PCICR |= _BV(PCIE0);
+    } else {
+        PCICR &= ~_BV(PCIE0);
+        PCMSK0 &= ~_BV(OPT_SPI_SS_PCINT);
+    }
+}
+
+// only wakes the CPU, see opt_spi_wake_on_ss()
+EMPTY_INTERRUPT(PCINT0_vect)
+
+// starts timing out the command frame being received, called from the SPI
+// interrupt after its first byte
+void opt_start_rx_timeout(void){
+    TCNT1 = 0;
+    TIFR1 = _BV(OCF1A);
+    TCCR1B = _BV(WGM12) | _BV(CS12) | _BV(CS10);   // clk/1024
+}
+
+// stops the command frame timeout, Timer1 is unclocked while no frame is in
+// progress so it doesn't wake the CPU from idle
+void opt_stop_rx_timeout(void){
+    TCCR1B = _BV(WGM12);
+}
+
+// the second byte of a command frame never arrived, drop the partial frame so
+// the next byte from PAY-SSM starts a new one
+ISR(TIMER1_COMPA_vect){
+    opt_stop_rx_timeout();
+    if (opt_spi_rx_count > 0){
+        opt_spi_rx_count = 0;
+        opt_spi_dropped_count++;
+        // don't clock the stale ACK/NACK out as the first byte of the next frame
+        SPDR = 0x00;
+    }
 }
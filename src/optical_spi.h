@@ -9,6 +9,12 @@
 #include <uart/uart.h>
 #include <utilities/utilities.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <util/atomic.h>
+#include <avr/sleep.h>
+#include <avr/power.h>
+#include <queue/queue.h>
 #include "optical.h"
 #include "power.h"
 
@@ -19,28 +25,122 @@
 #define DATA_RDYn_DDR   DDRD
 #define DATA_RDYn_PIN   PIND
 
+// SPI slave select input, low while PAY-SSM is clocking a transfer
+#define OPT_SPI_SS      PB2
+#define OPT_SPI_SS_PIN  PINB
+// pin change interrupt of SS, in PCMSK0
+#define OPT_SPI_SS_PCINT PCINT2
+
 
 /* SPI OPCODES */
 #define CMD_GET_READING             0x01    // 1 cmd byte, followed by 1 byte of well_data
 #define CMD_GET_POWER               0x02
 #define CMD_ENTER_SLEEP_MODE        0x03
 #define CMD_ENTER_NORMAL_MODE       0x04
+#define CMD_GET_POWER_HIRES         0x05    // 1 cmd byte, followed by 1 byte of options
+
+#define CMD_ARM_POWER_CAPTURE       0x06
+#define CMD_READ_POWER_CAPTURE      0x07    // 1 cmd byte, followed by 1 byte chunk number
+#define CMD_GET_READING_CHARGE      0x08    // 1 cmd byte, followed by 1 byte of well_data
+#define CMD_GET_WELL_CHARGE         0x09    // 1 cmd byte, followed by 1 byte well number
+// same as CMD_GET_READING and CMD_GET_READING_CHARGE with a 7 bit well number
+#define CMD_GET_READING_WIDE        0x0A    // 1 cmd byte, followed by 1 byte of wide well_data
+#define CMD_GET_READING_CHARGE_WIDE 0x0B    // 1 cmd byte, followed by 1 byte of wide well_data
+// read every well of a board at once, then collect the readings one by one
+#define CMD_SCAN_PLATE              0x0C    // 1 cmd byte, followed by 1 byte of scan options
+#define CMD_GET_LAST_READING        0x0D    // 1 cmd byte, followed by 1 byte of wide well_data
+// opcodes are numbered without gaps, anything outside this range is NACKed
+#define CMD_FIRST                   CMD_GET_READING
+#define CMD_LAST                    CMD_GET_LAST_READING
+
+// CMD_GET_POWER_HIRES options byte
+// bits 2:0 - number of extra bits (4^n samples per channel)
+// bit 7 - use ADC noise reduction sleep
+#define OPT_HIRES_BITS_MASK     0x07
+#define OPT_HIRES_NR_BIT        7
+// CMD_GET_POWER_HIRES response: 16 bit voltage then 16 bit current, MSB first
+#define SPI_HIRES_TX_COUNT      4
+// CMD_READ_POWER_CAPTURE response: capture state then one chunk of samples
+#define SPI_CAPTURE_CHUNK       6
+// CMD_GET_READING_CHARGE response: 3 byte reading then 3 byte charge
+// Charges are the board current integrated over time, in ADC current counts *
+// ms. With the scale power_read_current() uses (1 count = 3.3 / 1024 mA):
+//     charge (uC) = charge * 3.3 / 1024
+//     energy (uJ) = charge (uC) * supply voltage (V, from CMD_GET_POWER)
+#define SPI_CHARGE_TX_COUNT     6
+// CMD_GET_WELL_CHARGE response: 32 bit charge, MSB first
+#define SPI_WELL_CHARGE_TX_COUNT 4
+// CMD_GET_WELL_CHARGE: bit 7 of the well byte clears the counter after reading,
+// bits 6:0 are the well number
+#define OPT_CHARGE_CLEAR_BIT    7
+// CMD_SCAN_PLATE options byte: bit 7 is the test type, all of that board's LEDs
+// are lit for the scan (see scan_opt_sensor_plate())
+// The response is the number of wells out of range, 3 bytes like CMD_GET_READING
+#define OPT_SCAN_TYPE_BIT       7
+// CMD_GET_LAST_READING response: the well's last reading (3 bytes, same format
+// as CMD_GET_READING, nothing is measured) then 1 if it was out of range in the
+// last CMD_SCAN_PLATE, or 0
+#define SPI_LAST_READING_TX_COUNT 4
+// Reading and well charge commands for a well that doesn't exist on this board
+// are answered with a response of the normal length filled with this byte, so
+// PAY-SSM stays in step with its queued commands. A reading never has bits
+// 21:19 set, so it can't be mistaken for one; a well charge of all ones may
+// also be a saturated counter
+#define OPT_SPI_INVALID         0xFF
 
-// test type and field (well) number bits
+// well_data: bit 5 is the test type, bits 4:0 the field (well) number
 #define OPT_TYPE_BIT        5
 #define FIELD_NUMBER_BIT    4
+#define OPT_FIELD_MASK      0x1F
+// wide well_data: bit 7 is the test type, bits 6:0 the field (well) number
+#define OPT_WIDE_TYPE_BIT   7
+#define OPT_WIDE_FIELD_MASK 0x7F
 
+// number of command bytes
+#define SPI_RX_COUNT 2
+// a command frame whose second byte doesn't arrive within this time is
+// discarded, so a stray or lost byte can't shift the framing of later commands
+#define SPI_RX_TIMEOUT_MS       100
+// Timer1 compare value for SPI_RX_TIMEOUT_MS, with the clk/1024 prescaler
+#define SPI_RX_TIMEOUT_TICKS    ((uint16_t)((SPI_RX_TIMEOUT_MS * (F_CPU / 1024UL)) / 1000UL))
 // number of return bytes
 #define SPI_TX_COUNT 3
+// maximum number of return bytes, one response queue element holds the length
+// followed by the data
+#define SPI_MAX_TX_COUNT (QUEUE_DATA_SIZE - 1)
+
+// returned during the second command byte
+// The answer is decided when the first byte arrives, a NACKed frame is always
+// dropped even if the queue has room by the time the second byte arrives
+#define OPT_SPI_ACK     0x06    // command queued
+#define OPT_SPI_NACK    0x15    // command queue full or unknown opcode, command dropped
+
+// The CPU may be in ADC noise reduction sleep (CMD_GET_POWER_HIRES), which stops
+// the SPI clock. SS going low wakes it, PAY-SSM must leave at least
+// SPI_SS_LEAD_US between pulling SS low and the first SCK edge
+#define SPI_SS_LEAD_US  10
+
+// PAY-SSM must not send a command while DATA_RDYn is low, every byte clocked
+// then shifts out a response byte and the command bytes are ignored
 
 
 void init_opt_spi(void);
 void opt_set_data_rdy_low();
 void opt_set_data_rdy_high();
 void opt_loop_main(void);
+bool opt_has_work(void);
+void opt_idle(void);
 
 void manage_cmd (uint8_t spi_first_byte, uint8_t spi_second_byte);
+bool opt_decode_well_info(uint8_t cmd, uint8_t well_info, uint8_t* pos, pay_board_t* board);
 void opt_update_reading(uint8_t well_info);
 void opt_transfer_bytes (uint32_t data);
+void opt_queue_response(const uint8_t* data, uint8_t len);
+void opt_queue_invalid_response(uint8_t len);
+void opt_start_next_response(void);
+bool opt_spi_active(void);
+void opt_spi_wake_on_ss(bool enable);
+void opt_start_rx_timeout(void);
+void opt_stop_rx_timeout(void);
 
 #endif // OPTICAL_SPI_H
@@ -7,13 +7,43 @@ pin_info_t load_switch_en = {
     .pin = LOAD_SWITCH_PIN
 };
 
+// What the ADC interrupt is currently doing
+volatile adc_mode_t adc_mode = ADC_MODE_IDLE;
+
+// Background sampler state, written by the ADC interrupt
+volatile uint8_t sampler_channel = POWER_CURR_CHANNEL;
+volatile adc_stats_t power_curr_stats;
+volatile adc_stats_t power_volt_stats;
+// Sum of the current samples since reset_charge_measurement()
+volatile uint32_t power_curr_sum = 0;
+
+// Burst capture of the current channel, 8 bit samples
+uint8_t power_capture_buf[POWER_CAPTURE_SIZE] = {0x00};
+volatile uint8_t power_capture_count = 0;
+volatile power_capture_state_t power_capture_state = POWER_CAPTURE_IDLE;
+// whether the background sampler was running when the capture started
+bool power_capture_resume = false;
+
+// Result of the last ADC_MODE_ONESHOT conversion
+volatile uint16_t adc_oneshot_result = 0;
+volatile bool adc_oneshot_done = false;
+
 
 /*
 Initialize the power module
 */
 void init_power(){
+    // stop the timer clocks for idle sleep, start_power_sampler() turns Timer0
+    // back on to trigger the ADC and init_opt_spi() Timer1 for the SPI command
+    // frame timeout
+    power_timer0_disable();
+    power_timer1_disable();
+    power_timer2_disable();
+
     init_adc();
     init_output_pin(load_switch_en.pin, load_switch_en.ddr, 1);
+    reset_power_stats();
+    start_power_sampler();
 }
 
 /*
@@ -21,18 +51,20 @@ Execute all important initializations for the board upon power-up
 */
 void init_board(){
     init_uart();
-    print("-- UART initialized\n");
+    PRINT("-- UART initialized\n");
     init_power();
-    print("-- Power module initialized\n");
+    PRINT("-- Power module initialized\n");
     init_i2c();
-    print("-- I2C initialized\n");
+    PRINT("-- I2C initialized\n");
     init_spi();
-    print("-- SPI Initialized\n");
+    PRINT("-- SPI Initialized\n");
     init_board_sensors();
-    print("-- Board initialized\n");
+    PRINT("-- Board initialized\n");
+    init_wells();
+    PRINT("-- Wells initialized\n");
 
     init_opt_spi();
-    print("-- SPI Comms initialized\n");
+    PRINT("-- SPI Comms initialized\n");
 }
 
 /*
@@ -40,58 +72,115 @@ Power cycle the board sensors and initialize them
 */
 void init_board_sensors(){
     // Ensure that the sensors have been reset
-    print("-- Power cycling the sensor ICs\n");
+    PRINT("-- Power cycling the sensor ICs\n");
     // disable_sensor_power();
     // enable_sensor_power();
 
     init_all_pex();
-    print("-- Port expanders initialized\n");
+    PRINT("-- Port expanders initialized\n");
     init_all_mux();
-    print("-- Mux's initialized\n");
+    PRINT("-- Mux's initialized\n");
     init_opt_sensors();
-    print("-- Light sensors initialized\n");
+    PRINT("-- Light sensors initialized\n");
 }
 
 /*
 Disable the power supply to the sensors
+Returns once the rail has discharged, or POWER_RAIL_TIMEOUT if it doesn't
 */
-void disable_sensor_power(){
+power_rail_status_t disable_sensor_power(){
+    trigger_power_capture();
     set_pin_low(load_switch_en.pin, load_switch_en.port);
-    // testing showed that it took around 350 ms for the board to discharge
-    _delay_ms(350);
+    // the sensors lose their register contents
+    invalidate_opt_sensors();
+    return wait_for_sensor_rail(false, POWER_RAIL_OFF_TIMEOUT);
 }
 
 /*
 Enable the power supply to the sensors
+Returns once the rail is up and the sensors are out of reset, or
+POWER_RAIL_TIMEOUT if it doesn't come up
 */
-void enable_sensor_power(){
+power_rail_status_t enable_sensor_power(){
+    trigger_power_capture();
     set_pin_high(load_switch_en.pin, load_switch_en.port);
-    // testing showed that it took < 1 ms for the board to charge
-    _delay_ms(1);
+    // the sensors come up with their reset register values
+    invalidate_opt_sensors();
+
+    power_rail_status_t status = wait_for_sensor_rail(true, POWER_RAIL_ON_TIMEOUT);
+    if (status == POWER_RAIL_OK){
+        _delay_ms(POWER_RAIL_ON_SETTLE_MS);
+    }
+    return status;
+}
+
+/*
+Poll the sensor rail voltage about once per ms until it crosses the on or off
+threshold
+on - true to wait for POWER_RAIL_ON_THRES, false for POWER_RAIL_OFF_THRES
+timeout_ms - maximum time to wait
+*/
+power_rail_status_t wait_for_sensor_rail(bool on, uint16_t timeout_ms){
+    for (uint16_t t = 0; t <= timeout_ms; t++){
+        uint16_t voltage = power_read_voltage();
+        if (on ? (voltage >= POWER_RAIL_ON_THRES) : (voltage <= POWER_RAIL_OFF_THRES)){
+            return POWER_RAIL_OK;
+        }
+        _delay_ms(1);
+    }
+
+    LOG_ERROR("Sensor rail timeout (%s)\n", on ? "on" : "off");
+    return POWER_RAIL_TIMEOUT;
 }
 
 /*
 Puts the optical board into sleep mode
-Not implementing implement sleep mode on the micro
+The micro itself sleeps in the main loop between commands (see opt_idle()),
+the background sampler is stopped here so its interrupts don't keep waking it
 */
-void enter_sleep_mode(){
-    disable_sensor_power();
+power_rail_status_t enter_sleep_mode(){
+    power_rail_status_t status = disable_sensor_power();
+    stop_power_sampler();
+    return status;
 }
 
 /*
 Takes the optical board out of sleep mode
+The sensors are only initialized if the rail came up, and get back the
+calibration they had before sleep so the next readings don't recalibrate
 */
-void enter_normal_mode(){
-    enable_sensor_power();
-    init_board_sensors();
+power_rail_status_t enter_normal_mode(){
+    power_rail_status_t status = enable_sensor_power();
+    if (status == POWER_RAIL_OK){
+        init_board_sensors();
+        restore_opt_sensors_calibration();
+    }
+    start_power_sampler();
+    return status;
 }
 
 
 // returns raw current and voltage data from ADC, concated in 32 bits
+// uses the background sampler averages, falls back to a blocking read of each
+// channel if the sampler has no samples yet or is stopped (sleep mode)
 uint32_t read_raw_power(){ // nice name :^)
-    // 10 bits of data
-    uint16_t raw_current = read_adc_channel(POWER_CURR_CHANNEL);
-    uint16_t raw_voltage = read_adc_channel(POWER_VOLT_CHANNEL);
+    adc_stats_t curr;
+    adc_stats_t volt;
+    get_power_stats(&curr, &volt);
+    if (adc_mode != ADC_MODE_SAMPLER) {
+        curr.count = 0;
+        volt.count = 0;
+    }
+
+    // 10 bits of data, rounded from the averages
+    uint16_t raw_current = (curr.avg + _BV(ADC_AVG_SHIFT - 1)) >> ADC_AVG_SHIFT;
+    uint16_t raw_voltage = (volt.avg + _BV(ADC_AVG_SHIFT - 1)) >> ADC_AVG_SHIFT;
+    if (curr.count == 0) {
+        raw_current = read_adc_channel(POWER_CURR_CHANNEL);
+    }
+    if (volt.count == 0) {
+        raw_voltage = read_adc_channel(POWER_VOLT_CHANNEL);
+    }
 
     // voltage on left, current on right
     uint32_t raw_power = ((uint32_t) raw_voltage << 12) | ((uint32_t) raw_current);
@@ -102,52 +191,52 @@ uint32_t read_raw_power(){ // nice name :^)
 
 
 /*
-Return the current consumption of the board in mA
+Return the current consumption of the board in mA, Q4.12
 Returns total current going into the board from the SSM header
 */
-float power_read_current(){
+uint16_t power_read_current(){
     uint16_t raw_data = read_adc_channel(POWER_CURR_CHANNEL);
-    float current = convert_adc_data_to_voltage(raw_data, ADC_DEF_VREF);
+    uint16_t current = convert_adc_data_to_voltage(raw_data, ADC_DEF_VREF);
 
     return current;
 }
 
 /*
-Return the voltage of the sensor rail in V
+Return the voltage of the sensor rail in V, Q4.12
 Voltage is measured after load switch, so if the switch is disabled it should
 read ~0V
 */
-float power_read_voltage(){
+uint16_t power_read_voltage(){
     uint16_t raw_data = read_adc_channel(POWER_VOLT_CHANNEL);
-    float voltage = convert_adc_data_to_voltage(raw_data, ADC_DEF_VREF);
+    uint16_t voltage = convert_adc_data_to_voltage(raw_data, ADC_DEF_VREF);
 
     return voltage;
 }
 
 /*
-Return the power being used by the board
+Return the power being used by the board, with 12 fractional bits (Q20.12)
 If the load switch is disabled, the returned power should be ~0W because
 the voltage is measured after the load switch. Just take a current measurement
 and multiply by 3V3 to get "sleep" power.
 */
-float power_read_power(){
-    float current = power_read_current();
-    float voltage = power_read_voltage();
+uint32_t power_read_power(){
+    uint16_t current = power_read_current();
+    uint16_t voltage = power_read_voltage();
 
-    // see: ohm's law
-    float power = voltage * current;
+    // see: ohm's law, Q4.12 * Q4.12 = Q8.24
+    uint32_t power = ((uint32_t)voltage * current) >> ADC_Q_FRAC_BITS;
 
     return power;
 }
 
 /*
 Convert an ADC reading into a voltage
-Must supply the reference voltage
+Must supply the reference voltage, both are Q4.12
 */
-float convert_adc_data_to_voltage(uint16_t data, float vref){
+uint16_t convert_adc_data_to_voltage(uint16_t data, uint16_t vref){
     // vin = (ADC * Vref) / 1024
     // see page 262 for reference
-    float conversion = ((float)(data) * vref)/(_BV(10));
+    uint16_t conversion = ((uint32_t)data * vref) >> 10;
 
     return conversion;
 }
@@ -163,9 +252,11 @@ void init_adc(){
 /*
 Read the selected adc channel
 Not using ADC noise reduction mode
+The background sampler is paused for the conversion
 */
 uint16_t read_adc_channel(uint8_t channel){
     uint16_t adc_read = 0x0000;
+    bool resume = pause_power_sampler();
 
     set_adc_channel(channel);
     // enable ADC, single conversion, clear any ADIF flag, keep prescaler bits
@@ -181,9 +272,430 @@ uint16_t read_adc_channel(uint8_t channel){
     // disable ADC, clear ADIF flag, keep prescaler bits
     ADCSRA = _BV(ADIF) | (ADCSRA & ~ADC_PRESCALER_MASK);
 
+    if (resume) {
+        start_power_sampler();
+    }
+
     return adc_read;
 }
 
+// Account for a sampler slot without a conversion while the sampler is paused,
+// current slots add the running average to the charge sum
+static void skip_sampler_slot(void){
+    if (sampler_channel == POWER_CURR_CHANNEL) {
+        if (power_curr_stats.count > 0) {
+            power_curr_sum += (power_curr_stats.avg + _BV(ADC_AVG_SHIFT - 1)) >> ADC_AVG_SHIFT;
+        }
+        sampler_channel = POWER_VOLT_CHANNEL;
+    } else {
+        sampler_channel = POWER_CURR_CHANNEL;
+    }
+}
+
+// Move the paused sampler's Timer0 on by ticks, for time it was stopped in ADC
+// noise reduction sleep
+static void advance_sampler_timer(uint8_t ticks){
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        if (!(TIMSK0 & _BV(OCIE0A))) {
+            return;
+        }
+        uint16_t count = TCNT0 + ticks;
+        if (count > POWER_SAMPLER_TIMER_TOP) {
+            count -= POWER_SAMPLER_TIMER_TOP + 1;
+            skip_sampler_slot();
+        }
+        TCNT0 = count;
+    }
+}
+
+// Run one conversion in ADC_MODE_ONESHOT and wait for its interrupt
+static uint16_t convert_adc_oneshot(bool noise_reduction){
+    bool started = false;
+    adc_oneshot_done = false;
+
+    if (noise_reduction) {
+        set_sleep_mode(SLEEP_MODE_ADC);
+        opt_spi_wake_on_ss(true);
+        cli();
+        // other interrupts can wake the CPU before the conversion is done, so
+        // go back to sleep until it is (this doesn't start another conversion)
+        // clk_io stops while asleep and the SPI slave needs it, so stay awake
+        // once PAY-SSM may be clocking (SS going low wakes the CPU)
+        while (!adc_oneshot_done && !opt_spi_active()) {
+            // entering ADC noise reduction mode starts the conversion
+            sleep_enable();
+            sei();
+            sleep_cpu();
+            sleep_disable();
+            cli();
+            started = true;
+        }
+        sei();
+        opt_spi_wake_on_ss(false);
+    }
+
+    if (started) {
+        advance_sampler_timer(POWER_SAMPLER_NR_TICKS);
+    } else {
+        ADCSRA |= _BV(ADSC);
+    }
+    while (!adc_oneshot_done) {}
+
+    return adc_oneshot_result;
+}
+
+/*
+Read the selected adc channel with extra resolution by oversampling
+4^extra_bits samples are summed and decimated, giving 10 + extra_bits bits
+Interrupts must be enabled. The background sampler is paused for the
+conversions.
+channel - ADC channel
+extra_bits - number of extra bits, at most ADC_MAX_OVERSAMPLE_BITS
+noise_reduction - sleep in ADC noise reduction mode during each conversion,
+    this halts the I/O clock, so the UART is stalled until each conversion
+    finishes. Conversions that start while PAY-SSM may be clocking the SPI
+    link don't sleep, and SS going low wakes the CPU (see opt_spi_active())
+*/
+uint16_t read_adc_oversampled(uint8_t channel, uint8_t extra_bits, bool noise_reduction){
+    uint32_t sum = 0;
+
+    if (extra_bits > ADC_MAX_OVERSAMPLE_BITS) {
+        extra_bits = ADC_MAX_OVERSAMPLE_BITS;
+    }
+    bool resume = pause_power_sampler();
+
+    set_adc_channel(channel);
+    adc_mode = ADC_MODE_ONESHOT;
+    // enable ADC and its interrupt, clear any ADIF flag, keep prescaler bits
+    ADCSRA = _BV(ADEN) | _BV(ADIF) | _BV(ADIE) | (ADCSRA & ~ADC_PRESCALER_MASK);
+
+    uint16_t samples = (uint16_t)1 << (2 * extra_bits);
+    for (uint16_t i = 0; i < samples; i++) {
+        sum += convert_adc_oneshot(noise_reduction);
+    }
+
+    adc_mode = ADC_MODE_IDLE;
+    // disable ADC, clear ADIF flag, keep prescaler bits
+    ADCSRA = _BV(ADIF) | (ADCSRA & ~ADC_PRESCALER_MASK);
+
+    if (resume) {
+        start_power_sampler();
+    }
+
+    return (uint16_t)(sum >> extra_bits);
+}
+
+/*
+Start sampling the current and voltage channels in the background
+Timer0 auto triggers a conversion every 1 ms, and each conversion complete
+interrupt stores the result and selects the other channel for the next one, so
+the two channels are sampled alternately
+*/
+void start_power_sampler(){
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        adc_mode = ADC_MODE_SAMPLER;
+        sampler_channel = POWER_CURR_CHANNEL;
+        set_adc_channel(POWER_CURR_CHANNEL);
+
+        // Timer0 in CTC mode, stopped until the ADC is set up
+        power_timer0_enable();
+        TCCR0B = 0x00;
+        TIMSK0 = 0x00;
+        TCCR0A = _BV(WGM01);
+        TCNT0 = 0;
+        OCR0A = POWER_SAMPLER_TIMER_TOP;
+        TIFR0 = _BV(OCF0A);
+
+        // auto trigger on Timer0 compare match A
+        ADCSRB = (ADCSRB & ~(_BV(ADTS2) | _BV(ADTS1) | _BV(ADTS0))) |
+            _BV(ADTS1) | _BV(ADTS0);
+        // enable ADC, auto trigger and interrupt, keep prescaler bits
+        ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIF) | _BV(ADIE) |
+            (ADCSRA & ~ADC_PRESCALER_MASK);
+
+        TCCR0B = POWER_SAMPLER_TIMER_CS;
+    }
+}
+
+// End a burst capture and hand the ADC back, interrupts must be disabled
+static void stop_power_capture(power_capture_state_t state){
+    // disable ADC, clear ADIF flag
+    ADCSRA = _BV(ADIF) | (ADCSRA & ~ADC_PRESCALER_MASK);
+    ADMUX &= ~_BV(ADLAR);
+    set_adc_prescaler(ADC_DEF_PRESCALER);
+
+    adc_mode = ADC_MODE_IDLE;
+    power_capture_state = state;
+}
+
+/*
+Stop the background sampler and wait for its conversion in progress
+A running burst capture is allowed to finish first (a few ms). With interrupts
+disabled it never would, so it is abandoned instead
+The statistics are kept. Timer0 keeps running, and the current samples missed
+until start_power_sampler() are counted at the running average, so the charge
+of a reading includes one-shot reads and captures
+Returns true if it was running, so the caller can restart it
+*/
+bool pause_power_sampler(){
+    while (adc_mode == ADC_MODE_CAPTURE) {
+        if (!(SREG & _BV(SREG_I))) {
+            stop_power_capture(POWER_CAPTURE_IDLE);
+            return power_capture_resume;
+        }
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        if (adc_mode != ADC_MODE_SAMPLER) {
+            return false;
+        }
+        adc_mode = ADC_MODE_IDLE;
+        // stop triggering conversions, Timer0's own interrupt takes over
+        ADCSRA &= ~(_BV(ADIE) | _BV(ADATE));
+        TIFR0 = _BV(OCF0A);
+        TIMSK0 = _BV(OCIE0A);
+    }
+
+    while (ADCSRA & _BV(ADSC)) {}
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        // a conversion finished after its interrupt was disabled
+        if (ADCSRA & _BV(ADIF)) {
+            skip_sampler_slot();
+        }
+    }
+    // disable ADC, clear ADIF flag, keep prescaler bits
+    ADCSRA = _BV(ADIF) | (ADCSRA & ~ADC_PRESCALER_MASK);
+
+    return true;
+}
+
+/*
+Stop the background sampler and Timer0, for sleep mode
+Nothing is counted until start_power_sampler()
+*/
+void stop_power_sampler(){
+    pause_power_sampler();
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        TIMSK0 = 0x00;
+        TCCR0B = 0x00;
+        power_timer0_disable();
+    }
+}
+
+// Fills in the current samples of a paused sampler, see pause_power_sampler()
+ISR(TIMER0_COMPA_vect){
+    skip_sampler_slot();
+}
+
+// Restart the min/max window of one sampler channel
+static void reset_adc_stats(volatile adc_stats_t* stats){
+    stats->min = ADC_MAX_READING;
+    stats->max = 0;
+}
+
+/*
+Restart the min/max window of both sampler channels
+The running averages are kept
+*/
+void reset_power_stats(){
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        reset_adc_stats(&power_curr_stats);
+        reset_adc_stats(&power_volt_stats);
+    }
+}
+
+/*
+Copy out a consistent snapshot of the sampler statistics
+curr - statistics for POWER_CURR_CHANNEL
+volt - statistics for POWER_VOLT_CHANNEL
+*/
+void get_power_stats(adc_stats_t* curr, adc_stats_t* volt){
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        *curr = power_curr_stats;
+        *volt = power_volt_stats;
+    }
+}
+
+// Add one sample to the statistics of a sampler channel
+static void update_adc_stats(volatile adc_stats_t* stats, uint16_t sample){
+    if (stats->count == 0) {
+        stats->avg = sample << ADC_AVG_SHIFT;
+    } else {
+        int16_t diff = (int16_t)(sample << ADC_AVG_SHIFT) - (int16_t)stats->avg;
+        // round to nearest, a plain shift rounds negative diffs down and lets
+        // the average settle up to 1 LSB low
+        stats->avg += (diff + _BV(ADC_AVG_SHIFT - 1)) >> ADC_AVG_SHIFT;
+    }
+
+    if (sample < stats->min) {
+        stats->min = sample;
+    }
+    if (sample > stats->max) {
+        stats->max = sample;
+    }
+    if (stats->count < UINT16_MAX) {
+        stats->count++;
+    }
+}
+
+/*
+Start integrating the board current for charge accounting
+*/
+void reset_charge_measurement(){
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        power_curr_sum = 0;
+    }
+}
+
+/*
+Return the board current integrated since reset_charge_measurement(), in ADC
+current counts * ms (see CMD_GET_READING_CHARGE for the conversion to uC and
+uJ). Time with the sampler paused is counted at the running average current,
+time in sleep mode (sampler stopped) is not.
+Valid for windows of up to ~1 hour
+*/
+uint32_t read_charge_measurement(){
+    uint32_t sum;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        sum = power_curr_sum;
+    }
+    return sum * POWER_CURR_SAMPLE_PERIOD_MS;
+}
+
+/*
+Arm a burst capture of the current channel
+The capture starts on the next LED switch (set_led()) or sensor rail switch,
+and any previous capture is discarded
+*/
+void arm_power_capture(){
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        if (power_capture_state != POWER_CAPTURE_RUNNING) {
+            power_capture_state = POWER_CAPTURE_ARMED;
+        }
+    }
+}
+
+/*
+Start the armed capture, called just before switching a load
+Runs the ADC free running at ADC_CAPTURE_PRESCALER with left adjusted results,
+keeping the top 8 bits of each sample. The background sampler is paused until
+the buffer is full. Does nothing if no capture is armed
+*/
+void trigger_power_capture(){
+    if (power_capture_state != POWER_CAPTURE_ARMED) {
+        return;
+    }
+    power_capture_resume = pause_power_sampler();
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        power_capture_count = 0;
+        power_capture_state = POWER_CAPTURE_RUNNING;
+        adc_mode = ADC_MODE_CAPTURE;
+
+        set_adc_channel(POWER_CURR_CHANNEL);
+        set_adc_prescaler(ADC_CAPTURE_PRESCALER);
+        ADMUX |= _BV(ADLAR);
+        // free running mode
+        ADCSRB &= ~(_BV(ADTS2) | _BV(ADTS1) | _BV(ADTS0));
+        // enable ADC, auto trigger and interrupt, start, keep prescaler bits
+        ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIF) | _BV(ADIE) |
+            (ADCSRA & ~ADC_PRESCALER_MASK);
+    }
+}
+
+// Stop the capture once the buffer is full, called from the ADC interrupt
+static void finish_power_capture(void){
+    stop_power_capture(POWER_CAPTURE_DONE);
+    if (power_capture_resume) {
+        start_power_sampler();
+    }
+}
+
+power_capture_state_t get_power_capture_state(){
+    return power_capture_state;
+}
+
+/*
+Copy part of a finished capture
+data - destination for len bytes, bytes past the end of the capture are 0
+offset - index of the first sample to copy
+Returns the number of samples copied, 0 if there is no finished capture
+*/
+uint8_t read_power_capture(uint8_t* data, uint16_t offset, uint8_t len){
+    uint8_t count = 0;
+
+    for (uint8_t i = 0; i < len; i++) {
+        data[i] = 0x00;
+        if (power_capture_state == POWER_CAPTURE_DONE &&
+                offset + i < POWER_CAPTURE_SIZE) {
+            data[i] = power_capture_buf[offset + i];
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/*
+Print a finished capture over UART, 16 samples per line
+Waits for room in the UART buffer so no samples are dropped, this holds up the
+main loop for about 0.4 s at 9600 baud, then goes back to the previous policy
+*/
+void print_power_capture(){
+    if (power_capture_state != POWER_CAPTURE_DONE) {
+        PRINT("No power capture\n");
+        return;
+    }
+
+    uart_tx_policy_t policy = get_uart_tx_policy();
+    set_uart_tx_policy(UART_TX_BLOCK);
+    PRINT("Power capture:\n");
+    for (uint8_t i = 0; i < POWER_CAPTURE_SIZE; i += 16) {
+        print_bytes(power_capture_buf + i, 16);
+    }
+    set_uart_tx_policy(policy);
+}
+
+/*
+ADC conversion complete interrupt, shared by the ADC modes
+*/
+ISR(ADC_vect){
+    uint16_t sample = ADC;
+
+    switch (adc_mode) {
+        case ADC_MODE_SAMPLER:
+            if (sampler_channel == POWER_CURR_CHANNEL) {
+                update_adc_stats(&power_curr_stats, sample);
+                power_curr_sum += sample;
+                sampler_channel = POWER_VOLT_CHANNEL;
+            } else {
+                update_adc_stats(&power_volt_stats, sample);
+                sampler_channel = POWER_CURR_CHANNEL;
+            }
+            set_adc_channel(sampler_channel);
+            // the trigger is the flag's rising edge, clear it for the next match
+            TIFR0 = _BV(OCF0A);
+            break;
+
+        case ADC_MODE_ONESHOT:
+            adc_oneshot_result = sample;
+            adc_oneshot_done = true;
+            break;
+
+        case ADC_MODE_CAPTURE:
+            // left adjusted, the top 8 bits are in ADCH
+            power_capture_buf[power_capture_count] = sample >> 8;
+            power_capture_count++;
+            if (power_capture_count >= POWER_CAPTURE_SIZE) {
+                finish_power_capture();
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
 /*
 Set the ADC channel bits in ADMUX
 Input channels range from 0-7
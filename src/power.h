@@ -6,9 +6,12 @@
 #define POWER_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <avr/io.h>
 #include <utilities/utilities.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/power.h>
 #include <uart/uart.h>
 #include <i2c/i2c.h>
 #include <spi/spi.h>
@@ -22,33 +25,131 @@
 #define LOAD_SWITCH_DDR         DDRB
 #define LOAD_SWITCH_PORT        PORTB
 
+/* SENSOR RAIL DEFINES */
+// Converts millivolts to Q4.12
+#define POWER_MV_TO_Q12(mv)     ((uint16_t)(((uint32_t)(mv) << ADC_Q_FRAC_BITS) / 1000))
+// The rail is off below this voltage and on above this voltage
+#define POWER_RAIL_OFF_THRES    POWER_MV_TO_Q12(300)
+#define POWER_RAIL_ON_THRES     POWER_MV_TO_Q12(3000)
+// Maximum time to wait for the rail, in ms
+// Testing showed the board takes around 350 ms to discharge and < 1 ms to charge
+#define POWER_RAIL_OFF_TIMEOUT  500
+#define POWER_RAIL_ON_TIMEOUT   10
+// Time for the sensors to finish their power-on reset once the rail is up
+#define POWER_RAIL_ON_SETTLE_MS 1
+
+typedef enum {
+    POWER_RAIL_OK = 0,
+    // the rail didn't reach the threshold in time, e.g. a failed load switch
+    POWER_RAIL_TIMEOUT = 1
+} power_rail_status_t;
+
 /* ADC DEFINES */
 #define ADC_MUX_MASK        0xF0
 #define ADC_VREF_MASK       0x3F
 #define ADC_PRESCALER_MASK  0xF8
 
+// Voltages, currents and powers are unsigned Q4.12 fixed point (1/4096 units)
+#define ADC_Q_FRAC_BITS     12
+
 // AVCC, see page 264
 #define ADC_DEF_VREF_BITS   0b01
-#define ADC_DEF_VREF        3.3
+// 3.3V in Q4.12
+#define ADC_DEF_VREF        13517
 // Divide f_osc by 64, see page 255 and 267  
 #define ADC_DEF_PRESCALER   0b110
 
+/* ADC SAMPLER DEFINES */
+// Weight of each new sample in the running averages, 1 / 2^ADC_AVG_SHIFT
+// The averages keep ADC_AVG_SHIFT fractional bits
+#define ADC_AVG_SHIFT       4
+// Reset values for the min/max tracking
+#define ADC_MAX_READING     0x3FF
+
+/* CHARGE ACCOUNTING DEFINES */
+// The background sampler starts a conversion on every Timer0 compare match, so
+// the samples are evenly spaced however late the ADC interrupt runs
+// Timer0 runs at f_osc / 64 and matches every 1 ms
+#define POWER_SAMPLER_TIMER_CS      (_BV(CS01) | _BV(CS00))
+#define POWER_SAMPLER_TIMER_TOP     ((F_CPU / 64 / 1000) - 1)
+// The channels alternate, so the current is sampled every 2 ms
+#define POWER_CURR_SAMPLE_PERIOD_MS 2
+// Timer0 stops in ADC noise reduction sleep. A conversion takes 13 ADC clocks,
+// which is 13 Timer0 ticks since both divide f_osc by 64
+#define POWER_SAMPLER_NR_TICKS      13
+
+#if POWER_SAMPLER_TIMER_TOP > 0xFF
+#error "The sampler period doesn't fit in Timer0"
+#endif
+
+/* ADC OVERSAMPLING DEFINES */
+// 4^n samples are summed and shifted right by n for n extra bits, e.g. 2 gives
+// 12 bits from 16 samples and 3 gives 13 bits from 64 samples
+#define ADC_MAX_OVERSAMPLE_BITS 4
+
+/* POWER CAPTURE DEFINES */
+// Number of 8 bit current samples in a burst capture
+#define POWER_CAPTURE_SIZE      128
+// Divide f_osc by 16 (500 kHz ADC clock, ~38k samples/s), fine for 8 bits
+#define ADC_CAPTURE_PRESCALER   0b100
+
+typedef enum {
+    POWER_CAPTURE_IDLE,
+    // waiting for an LED or the sensor rail to switch
+    POWER_CAPTURE_ARMED,
+    POWER_CAPTURE_RUNNING,
+    // buffer is full and can be read
+    POWER_CAPTURE_DONE
+} power_capture_state_t;
+
+// Owner of the ADC conversion complete interrupt
+typedef enum {
+    ADC_MODE_IDLE,
+    ADC_MODE_SAMPLER,
+    ADC_MODE_ONESHOT,
+    ADC_MODE_CAPTURE
+} adc_mode_t;
+
+// Statistics for one channel of the background sampler
+typedef struct {
+    // exponential moving average, with ADC_AVG_SHIFT fractional bits
+    uint16_t avg;
+    uint16_t min;
+    uint16_t max;
+    // number of samples taken, saturates at UINT16_MAX
+    uint16_t count;
+} adc_stats_t;
+
 /* FUNCTION PROTOTYPES */
 void init_power();
 void init_board();
 void init_board_sensors();
-void disable_sensor_power();
-void enable_sensor_power();
-void enter_sleep_mode();
-void enter_normal_mode();
-float power_read_current();
-float power_read_voltage();
-float power_read_power();
+power_rail_status_t disable_sensor_power();
+power_rail_status_t enable_sensor_power();
+power_rail_status_t wait_for_sensor_rail(bool on, uint16_t timeout_ms);
+power_rail_status_t enter_sleep_mode();
+power_rail_status_t enter_normal_mode();
+uint16_t power_read_current();
+uint16_t power_read_voltage();
+uint32_t power_read_power();
 uint32_t read_raw_power();
+void start_power_sampler();
+bool pause_power_sampler();
+void stop_power_sampler();
+void reset_power_stats();
+void get_power_stats(adc_stats_t* curr, adc_stats_t* volt);
+void reset_charge_measurement();
+uint32_t read_charge_measurement();
+void arm_power_capture();
+void trigger_power_capture();
+power_capture_state_t get_power_capture_state();
+uint8_t read_power_capture(uint8_t* data, uint16_t offset, uint8_t len);
+void print_power_capture();
 
-float convert_adc_data_to_voltage(uint16_t data, float vref);
+uint16_t convert_adc_data_to_voltage(uint16_t data, uint16_t vref);
 void init_adc();
 uint16_t read_adc_channel(uint8_t channel);
+uint16_t read_adc_oversampled(uint8_t channel, uint8_t extra_bits, bool noise_reduction);
 void set_adc_channel(uint8_t channel);
 void set_adc_vref(uint8_t vref);
 void set_adc_prescaler(uint8_t prescaler);
@@ -0,0 +1,246 @@
+#!/usr/bin/env python3
+"""
+Generates the well routing tables from a board description
+
+Usage:
+    gen_board.py <board description> <output directory>
+
+Writes three headers to the output directory:
+    opt_board.h   - board dimensions and the mux/pex object lists
+    opt_routes.h  - the routing tables in flash, only included by optical.c
+    opt_devices.h - the mux, pex and reset pin objects, only included by
+                    optical.c
+
+See board/pay_optical.txt for the description format.
+"""
+
+import os
+import re
+import sys
+
+# pay_board_t values, the LED route table is indexed by them
+BOARDS = {"led": 0, "optical": 1}
+
+# The TCA9548 has 3 address pins, so at most 8 fit on one bus, and the
+# firmware keeps a bit per port expander in 8 bit masks (see src/optical.h)
+MAX_MUXES = 8
+MAX_PEXES = 8
+
+# Both chips take a 3 bit address from their A2-A0 pins
+MAX_ADDR = 7
+# Reset pins are given as the pin name, e.g. PC3
+PIN_NAME = re.compile(r"^P([B-D])([0-7])$")
+
+MUX_CHANNELS = 8
+PEX_PINS = 16
+
+
+class BoardError(Exception):
+    pass
+
+
+def parse_device(fail, name, addr, rst):
+    """Returns (name, address, reset pin as (port letter, pin) or None)"""
+    addr = int(addr, 0)
+    if not 0 <= addr <= MAX_ADDR:
+        fail("address %d out of range" % addr)
+    if rst == "none":
+        return (name, addr, None)
+    m = PIN_NAME.match(rst)
+    if not m:
+        fail("unknown reset pin '%s'" % rst)
+    return (name, addr, (m.group(1), int(m.group(2))))
+
+
+def parse(path):
+    muxes = []
+    pexes = []
+    pex_boards = []
+    devices = {"mux": [], "pex": []}
+    wells = {}
+
+    with open(path) as f:
+        for num, line in enumerate(f, 1):
+            fields = line.split("#", 1)[0].split()
+            if not fields:
+                continue
+
+            def fail(msg):
+                raise BoardError("%s:%d: %s" % (path, num, msg))
+
+            kind, args = fields[0], fields[1:]
+            if kind == "mux" and len(args) == 3:
+                muxes.append(args[0])
+                devices["mux"].append(parse_device(fail, args[0], args[1], args[2]))
+            elif kind == "pex" and len(args) == 4:
+                if args[1] not in BOARDS:
+                    fail("unknown board '%s'" % args[1])
+                pexes.append(args[0])
+                pex_boards.append(BOARDS[args[1]])
+                devices["pex"].append(parse_device(fail, args[0], args[2], args[3]))
+            elif kind == "well" and len(args) == 7:
+                well = int(args[0], 0)
+                if well in wells:
+                    fail("well %d listed twice" % well)
+                if args[1] not in muxes:
+                    fail("unknown mux '%s'" % args[1])
+                channel = int(args[2], 0)
+                if not 0 <= channel < MUX_CHANNELS:
+                    fail("mux channel %d out of range" % channel)
+
+                leds = {}
+                for board, (pex, pin) in zip(("optical", "led"),
+                        (args[3:5], args[5:7])):
+                    if pex not in pexes:
+                        fail("unknown pex '%s'" % pex)
+                    if pex_boards[pexes.index(pex)] != BOARDS[board]:
+                        fail("%s drives the other board's LEDs" % pex)
+                    pin = int(pin, 0)
+                    if not 0 <= pin < PEX_PINS:
+                        fail("pex pin %d out of range" % pin)
+                    leds[BOARDS[board]] = (pexes.index(pex), pin)
+
+                wells[well] = ((muxes.index(args[1]), channel), leds)
+            else:
+                fail("can't parse '%s'" % line.strip())
+
+    if len(muxes) > MAX_MUXES or len(pexes) > MAX_PEXES:
+        raise BoardError("%s: at most %d muxes and %d port expanders" %
+            (path, MAX_MUXES, MAX_PEXES))
+    for kind, devs in devices.items():
+        addrs = [addr for _, addr, _ in devs]
+        if len(set(addrs)) != len(addrs):
+            raise BoardError("%s: two %ses share an address" % (path, kind))
+    rsts = [rst for devs in devices.values() for _, _, rst in devs if rst]
+    if len(set(rsts)) != len(rsts):
+        raise BoardError("%s: two devices share a reset pin" % path)
+
+    if sorted(wells) != list(range(len(wells))):
+        raise BoardError("%s: wells must be numbered 0 to %d" % (path, len(wells) - 1))
+
+    # every sensor and every LED must belong to exactly one well
+    sensors = [wells[w][0] for w in wells]
+    if len(set(sensors)) != len(sensors):
+        raise BoardError("%s: two wells share a mux channel" % path)
+    for board in BOARDS.values():
+        leds = [wells[w][1][board] for w in wells]
+        if len(set(leds)) != len(leds):
+            raise BoardError("%s: two wells share an LED" % path)
+
+    return devices, pex_boards, [wells[w] for w in sorted(wells)]
+
+
+def format_table(values, indent="    ", per_line=8):
+    lines = []
+    for i in range(0, len(values), per_line):
+        lines.append(indent + ", ".join("0x%02X" % v for v in values[i:i + per_line]))
+    return ",\n".join(lines)
+
+
+def format_devices(devices):
+    lines = ["/* RESET PINS */"]
+    for devs in devices.values():
+        for name, _, rst in devs:
+            if rst is None:
+                continue
+            port, pin = rst
+            lines += [
+                "pin_info_t %s_RST = {" % name,
+                "    .port = &PORT%s," % port,
+                "    .ddr = &DDR%s," % port,
+                "    .pin = P%s%d" % (port, pin),
+                "};",
+                ""]
+
+    for kind, title in (("mux", "MUX"), ("pex", "PORT EXPANDER")):
+        lines.append("/* %s OBJECTS */" % title)
+        for name, addr, rst in devices[kind]:
+            lines += [
+                "%s_t %s = {" % (kind, name),
+                "    .addr = 0b%s," % format(addr, "03b"),
+                "    .rst = %s" % ("&%s_RST" % name if rst else "NULL"),
+                "};",
+                ""]
+    return lines
+
+
+def generate(path, out_dir):
+    devices, pex_boards, wells = parse(path)
+    muxes = [name for name, _, _ in devices["mux"]]
+    pexes = [name for name, _, _ in devices["pex"]]
+    source = os.path.relpath(path, os.path.dirname(os.path.abspath(__file__)) + "/..")
+    banner = "// Generated by tools/gen_board.py from %s, do not edit" % source
+
+    board_h = [banner, "",
+        "#ifndef OPT_BOARD_H",
+        "#define OPT_BOARD_H",
+        "",
+        "#define OPT_BOARD_WELL_COUNT    %d" % len(wells),
+        "#define OPT_BOARD_MUX_COUNT     %d" % len(muxes),
+        "#define OPT_BOARD_PEX_COUNT     %d" % len(pexes),
+        "",
+        "// mux_t and pex_t objects, in index order",
+        "#define OPT_BOARD_MUXES         { %s }" % ", ".join("&" + m for m in muxes),
+        "#define OPT_BOARD_PEXES         { %s }" % ", ".join("&" + p for p in pexes),
+        "",
+        "// Bit n is set if pex n drives LEDs of the board",
+    ]
+    for name, board in sorted(BOARDS.items(), key=lambda b: b[1]):
+        mask = sum(1 << i for i, b in enumerate(pex_boards) if b == board)
+        board_h.append("#define OPT_BOARD_%s_PEX_MASK 0x%02X" % (name.upper(), mask))
+    board_h += ["", "#endif // OPT_BOARD_H", ""]
+
+    sensor_routes = [(mux << 3) | channel for (mux, channel), _ in wells]
+    led_routes = []
+    for board in sorted(BOARDS.values()):
+        led_routes.append([(leds[board][0] << 4) | leds[board][1] for _, leds in wells])
+
+    routes_h = [banner, "",
+        "#ifndef OPT_ROUTES_H",
+        "#define OPT_ROUTES_H",
+        "",
+        "#include <avr/pgmspace.h>",
+        '#include "opt_board.h"',
+        "",
+        "// Light sensor of each well: mux index << 3 | mux channel",
+        "static const uint8_t opt_sensor_routes[OPT_BOARD_WELL_COUNT] PROGMEM = {",
+        format_table(sensor_routes),
+        "};",
+        "",
+        "// LED of each well, indexed by pay_board_t: pex index << 4 | GPIO pin",
+        "static const uint8_t opt_led_routes[2][OPT_BOARD_WELL_COUNT] PROGMEM = {",
+        ",\n".join("    {\n%s\n    }" % format_table(r, indent="        ") for r in led_routes),
+        "};",
+        "",
+        "#endif // OPT_ROUTES_H",
+        ""]
+
+    devices_h = [banner, "",
+        "#ifndef OPT_DEVICES_H",
+        "#define OPT_DEVICES_H",
+        "",
+        "// Uses mux_t, pex_t and pin_info_t, include optical.h first",
+        ""] + format_devices(devices) + [
+        "#endif // OPT_DEVICES_H",
+        ""]
+
+    for name, lines in (("opt_board.h", board_h), ("opt_routes.h", routes_h),
+            ("opt_devices.h", devices_h)):
+        with open(os.path.join(out_dir, name), "w") as f:
+            f.write("\n".join(lines))
+
+
+def main(argv):
+    if len(argv) != 3:
+        print(__doc__.strip())
+        return 1
+    try:
+        generate(argv[1], argv[2])
+    except (BoardError, ValueError) as e:
+        print("gen_board.py: %s" % e, file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))